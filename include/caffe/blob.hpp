@@ -223,6 +223,12 @@ class Blob {
   const Dtype* cpu_diff() const;
   const Dtype* gpu_diff() const;
   Dtype* mutable_cpu_data();
+  /**
+   * @brief Like mutable_cpu_data, for callers that overwrite all of the data
+   *        before reading any of it, such as layers computing their top
+   *        blobs: the data keeps whatever values the memory has.
+   */
+  Dtype* write_only_cpu_data();
   Dtype* mutable_gpu_data();
   Dtype* mutable_cpu_diff();
   Dtype* mutable_gpu_diff();
@@ -262,6 +268,17 @@ class Blob {
    * shared_ptr calls its destructor when reset with the "=" operator.
    */
   void ShareDiff(const Blob& other);
+  /**
+   * @brief Set the data_ shared_ptr to point to the given SyncedMemory, of at
+   *        least count() elements -- used by Net to place blobs whose data is
+   *        never needed at the same time in the same memory.
+   *
+   * Reshaping the Blob to more than count() elements gives it memory of its
+   * own again.
+   */
+  void ShareDataMemory(const shared_ptr<SyncedMemory>& data);
+  /// @brief Like ShareDataMemory, for the diff_ shared_ptr.
+  void ShareDiffMemory(const shared_ptr<SyncedMemory>& diff);
 
   bool ShapeEquals(const BlobProto& other);
 
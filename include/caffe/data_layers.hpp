@@ -1,6 +1,7 @@
 #ifndef CAFFE_DATA_LAYERS_HPP_
 #define CAFFE_DATA_LAYERS_HPP_
 
+#include <deque>
 #include <string>
 #include <utility>
 #include <vector>
@@ -16,10 +17,14 @@
 #include "caffe/layer.hpp"
 #include "caffe/net.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/db.hpp"
+#include "caffe/util/image_cache.hpp"
 
 namespace caffe {
 
+class ThreadPool;
+
 /**
  * @brief Provides base for data layers that feed blobs to the Net.
  *
@@ -52,12 +57,65 @@ class BaseDataLayer : public Layer<Dtype> {
   bool output_labels_;
 };
 
+/**
+ * @brief Time a prefetching data layer spent in each stage of its pipeline,
+ *        in microseconds, summed over a number of batches.
+ *
+ * The prefetch thread times each batch as it loads it, and the times travel
+ * with the batch to Forward, which sums them without any locking.
+ */
+struct PrefetchStats {
+  PrefetchStats()
+      : batches(0), load_time(0), read_time(0), transform_time(0),
+        free_wait_time(0), forward_wait_time(0) { }
+  void Add(const PrefetchStats& other) {
+    batches += other.batches;
+    load_time += other.load_time;
+    read_time += other.read_time;
+    transform_time += other.transform_time;
+    free_wait_time += other.free_wait_time;
+    forward_wait_time += other.forward_wait_time;
+  }
+
+  int batches;
+  // Loading the batches on the prefetch thread, of which reading the
+  // records or files, and decoding and transforming them into the batch.
+  double load_time, read_time, transform_time;
+  // The prefetch thread waiting for Forward to free a batch.
+  double free_wait_time;
+  // Forward waiting for the prefetch thread to fill a batch, i.e. the time
+  // the net is input-bound.
+  double forward_wait_time;
+};
+
+template <typename Dtype>
+class Batch {
+ public:
+  Blob<Dtype> data_, label_;
+  // If set, holds the data instead of data_ as uncentered and unscaled bytes,
+  // and data_ only gives their shape.
+  shared_ptr<SyncedMemory> bytes_;
+  // Outputs beyond data_ and label_, for layers with more than two tops.
+  vector<shared_ptr<Blob<Dtype> > > extra_;
+  // The times of the last load of the batch.
+  PrefetchStats stats_;
+};
+
+/**
+ * @brief Base for data layers that load batches on a background thread.
+ *
+ * A single long-lived prefetch thread fills a pool of pre-allocated Batch%es
+ * (DataParameter.prefetch of them) and hands them to Forward through a pair
+ * of blocking queues, so a slow batch is absorbed by the ones queued ahead.
+ * Forward does not copy a batch: the top blobs are pointed at its buffers,
+ * and the batch is only recycled on the following Forward. Batches kept as
+ * bytes are instead centered and scaled into the top blob by Forward.
+ */
 template <typename Dtype>
 class BasePrefetchingDataLayer :
     public BaseDataLayer<Dtype>, public InternalThread {
  public:
-  explicit BasePrefetchingDataLayer(const LayerParameter& param)
-      : BaseDataLayer<Dtype>(param) {}
+  explicit BasePrefetchingDataLayer(const LayerParameter& param);
   virtual ~BasePrefetchingDataLayer() {}
   // LayerSetUp: implements common data layer setup functionality, and calls
   // DataLayerSetUp to do special data layer setup for individual layer types.
@@ -70,14 +128,31 @@ class BasePrefetchingDataLayer :
   virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
 
-  virtual void CreatePrefetchThread();
-  virtual void JoinPrefetchThread();
-  // The thread's function
-  virtual void InternalThreadEntry() {}
+  // The stage times of the batches forwarded since the last ResetStats.
+  const PrefetchStats& stats() const { return stats_; }
+  void ResetStats() { stats_ = PrefetchStats(); }
+  // Logs the average stage times per batch, if any batch was forwarded.
+  void LogStats() const;
 
  protected:
-  Blob<Dtype> prefetch_data_;
-  Blob<Dtype> prefetch_label_;
+  // The thread's function: loads batches until the thread is stopped.
+  virtual void InternalThreadEntry();
+  // Fills one batch; implemented by the individual layer types, which also
+  // record the read and transform times they measure in its stats_.
+  virtual void LoadBatch(Batch<Dtype>* batch) = 0;
+  // Frees the current batch and makes the next full one current.
+  void NextBatch();
+
+  vector<shared_ptr<Batch<Dtype> > > prefetch_;
+  BlockingQueue<Batch<Dtype>*> prefetch_free_;
+  BlockingQueue<Batch<Dtype>*> prefetch_full_;
+  // The batch currently exposed through the top blobs.
+  Batch<Dtype>* prefetch_current_;
+  PrefetchStats stats_;
+  // Per-channel mean and scale applied to batches kept as bytes.
+  Blob<Dtype> bytes_mean_;
+  Dtype bytes_scale_;
+
   Blob<Dtype> transformed_data_;
 };
 
@@ -85,7 +160,7 @@ template <typename Dtype>
 class DataLayer : public BasePrefetchingDataLayer<Dtype> {
  public:
   explicit DataLayer(const LayerParameter& param)
-      : BasePrefetchingDataLayer<Dtype>(param) {}
+      : BasePrefetchingDataLayer<Dtype>(param), next_record_(0) {}
   virtual ~DataLayer();
   virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
@@ -96,10 +171,26 @@ class DataLayer : public BasePrefetchingDataLayer<Dtype> {
   virtual inline int MaxTopBlobs() const { return 2; }
 
  protected:
-  virtual void InternalThreadEntry();
+  virtual void LoadBatch(Batch<Dtype>* batch);
+  // Reads the key index from the key_index file, or builds it from the DB.
+  void LoadKeyIndex(vector<string>* keys);
+  // Parses the current record of cursor into slot item_id and advances it.
+  virtual void ReadItem(db::Cursor* cursor, int item_id);
+  // Decodes and transforms the items of the batch assigned to worker_id.
+  virtual void DecodeItems(int worker_id, Batch<Dtype>* batch);
 
   shared_ptr<db::DB> db_;
   shared_ptr<db::Cursor> cursor_;
+  // One cursor per decode worker when parallel_read is set, else empty.
+  vector<shared_ptr<db::Cursor> > worker_cursors_;
+  // Number of records read by the batches loaded since SetUp.
+  size_t next_record_;
+  // Records of the batch being loaded, reused from batch to batch.
+  vector<Datum> batch_datums_;
+  // Each decode worker has its own transformer, and hence its own RNG
+  // stream, and always handles the same slots of the batch.
+  vector<shared_ptr<DataTransformer<Dtype> > > decode_transformers_;
+  shared_ptr<ThreadPool> decode_pool_;
 };
 
 /**
@@ -137,51 +228,56 @@ class DummyDataLayer : public Layer<Dtype> {
 /**
  * @brief Provides data to the Net from HDF5 files.
  *
- * TODO(dox): thorough documentation for Forward and proto params.
+ * Rows are read on the prefetch thread, window_size rows of a file at a time,
+ * and only the current window is kept in memory. With shuffle, rows are
+ * shuffled within each window.
  */
 template <typename Dtype>
-class HDF5DataLayer : public Layer<Dtype> {
+class HDF5DataLayer : public BasePrefetchingDataLayer<Dtype> {
  public:
   explicit HDF5DataLayer(const LayerParameter& param)
-      : Layer<Dtype>(param) {}
+      : BasePrefetchingDataLayer<Dtype>(param), file_id_(-1) {}
   virtual ~HDF5DataLayer();
-  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+  virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
-  // Data layers have no bottoms, so reshaping is trivial.
-  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top) {}
 
   virtual inline const char* type() const { return "HDF5Data"; }
   virtual inline int ExactNumBottomBlobs() const { return 0; }
   virtual inline int MinTopBlobs() const { return 1; }
 
  protected:
-  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top);
-  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top);
-  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
-      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {}
-  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
-      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {}
+  virtual void LoadBatch(Batch<Dtype>* batch);
+  // Opens the file, closing the previous one, and loads its first window.
   virtual void LoadHDF5FileData(const char* filename);
+  // Loads the next window of rows of the open file.
+  virtual void LoadHDF5Window();
+  virtual void ShuffleRows();
 
   std::vector<std::string> hdf_filenames_;
   unsigned int num_files_;
   unsigned int current_file_;
+  // Open file, its number of rows, and the first of them not yet loaded.
+  hid_t file_id_;
+  int file_rows_;
+  int file_row_;
+  // Row of the current window to output next.
   hsize_t current_row_;
   std::vector<shared_ptr<Blob<Dtype> > > hdf_blobs_;
   std::vector<unsigned int> data_permutation_;
   std::vector<unsigned int> file_permutation_;
+  shared_ptr<Caffe::RNG> prefetch_rng_;
 };
 
 /**
  * @brief Write blobs to disk as HDF5 files.
  *
- * TODO(dox): thorough documentation for Forward and proto params.
+ * Forward copies its bottoms into one of a few batch buffers and returns;
+ * a background thread appends the batches to chunked, extendable datasets,
+ * so outputs of any number of batches can be written at inference speed.
+ * The file is complete once the layer is destroyed or set up again.
  */
 template <typename Dtype>
-class HDF5OutputLayer : public Layer<Dtype> {
+class HDF5OutputLayer : public Layer<Dtype>, public InternalThread {
  public:
   explicit HDF5OutputLayer(const LayerParameter& param)
       : Layer<Dtype>(param), file_opened_(false) {}
@@ -208,13 +304,20 @@ class HDF5OutputLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
-  virtual void SaveBlobs();
+  // The thread's function: appends queued batches until given NULL.
+  virtual void InternalThreadEntry();
+  // Takes a free batch, shaped like the bottoms, for Forward to fill.
+  virtual Batch<Dtype>* NextBatch(const vector<Blob<Dtype>*>& bottom);
+  virtual void SaveBlobs(const Batch<Dtype>& batch);
+  // Writes out the queued batches, stops the thread and closes the file.
+  void CloseFile();
 
   bool file_opened_;
   std::string file_name_;
   hid_t file_id_;
-  Blob<Dtype> data_blob_;
-  Blob<Dtype> label_blob_;
+  vector<shared_ptr<Batch<Dtype> > > batches_;
+  BlockingQueue<Batch<Dtype>*> batch_free_;
+  BlockingQueue<Batch<Dtype>*> batch_full_;
 };
 
 /**
@@ -238,10 +341,21 @@ class ImageDataLayer : public BasePrefetchingDataLayer<Dtype> {
  protected:
   shared_ptr<Caffe::RNG> prefetch_rng_;
   virtual void ShuffleImages();
-  virtual void InternalThreadEntry();
+  virtual void LoadBatch(Batch<Dtype>* batch);
+  // File of the line id positions from the start of the epoch, continuing
+  // into the next epoch past the end of lines_.
+  const string& UpcomingFile(int id);
 
   vector<std::pair<std::string, int> > lines_;
   int lines_id_;
+  // Lines before this one, counted as in UpcomingFile, have had their files
+  // read ahead.
+  int readahead_id_;
+  // Order of lines_ in the next epoch when shuffling, drawn as soon as the
+  // readahead reaches it.
+  vector<int> next_order_;
+  // Decoded images kept across epochs, if image_data_param.cache_bytes > 0.
+  shared_ptr<ImageCache> image_cache_;
 };
 
 /**
@@ -253,7 +367,8 @@ template <typename Dtype>
 class MemoryDataLayer : public BaseDataLayer<Dtype> {
  public:
   explicit MemoryDataLayer(const LayerParameter& param)
-      : BaseDataLayer<Dtype>(param), has_new_data_(false) {}
+      : BaseDataLayer<Dtype>(param), has_new_data_(false),
+        ring_current_(NULL) {}
   virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
 
@@ -270,6 +385,22 @@ class MemoryDataLayer : public BaseDataLayer<Dtype> {
   void Reset(Dtype* data, Dtype* label, int n);
   void set_batch_size(int new_size);
 
+  // With memory_data_param.ring_size set, data is streamed through a ring of
+  // preallocated batches instead of Reset: producers fill free batches in
+  // place while Forward consumes full ones, and block while none is free.
+  // AddDatumVector and AddMatVector then transform each batch straight into
+  // the ring, so adding more batches than the ring holds must be done from
+  // another thread than the one running the net. Any number of producer
+  // threads may add batches at once; each batch is transformed by a
+  // transformer of its own.
+
+  // Blocks until a batch is free and returns it to be filled in place.
+  Batch<Dtype>* AcquireBatch();
+  // Queues a batch filled after AcquireBatch for Forward.
+  void PushBatch(Batch<Dtype>* batch);
+  // Copies batch_size items and their labels into the ring.
+  void AddBatch(const Dtype* data, const Dtype* labels);
+
   int batch_size() { return batch_size_; }
   int channels() { return channels_; }
   int height() { return height_; }
@@ -287,6 +418,15 @@ class MemoryDataLayer : public BaseDataLayer<Dtype> {
   Blob<Dtype> added_data_;
   Blob<Dtype> added_label_;
   bool has_new_data_;
+
+  vector<shared_ptr<Batch<Dtype> > > ring_;
+  BlockingQueue<Batch<Dtype>*> ring_free_;
+  BlockingQueue<Batch<Dtype>*> ring_full_;
+  // The batch shared with the top blobs, freed by the next Forward.
+  Batch<Dtype>* ring_current_;
+  // One transformer per batch of the ring, taken by the producer filling it.
+  vector<shared_ptr<DataTransformer<Dtype> > > ring_transformers_;
+  BlockingQueue<DataTransformer<Dtype>*> ring_transformer_free_;
 };
 
 /**
@@ -310,7 +450,9 @@ class WindowDataLayer : public BasePrefetchingDataLayer<Dtype> {
 
  protected:
   virtual unsigned int PrefetchRand();
-  virtual void InternalThreadEntry();
+  virtual void LoadBatch(Batch<Dtype>* batch);
+  // Loads, crops and warps the windows of the batch assigned to worker_id.
+  virtual void LoadWindows(int worker_id, Batch<Dtype>* batch);
 
   shared_ptr<Caffe::RNG> prefetch_rng_;
   vector<std::pair<std::string, vector<int> > > image_database_;
@@ -323,6 +465,16 @@ class WindowDataLayer : public BasePrefetchingDataLayer<Dtype> {
   bool has_mean_values_;
   bool cache_images_;
   vector<std::pair<std::string, Datum > > image_database_cache_;
+  // Windows sampled ahead of the batches that use them, and whether to
+  // mirror each, in batch order.
+  std::deque<std::pair<vector<float>, bool> > sampled_windows_;
+  // Position in its batch of the next window to sample.
+  int sampled_item_id_;
+  // Windows of the batch being loaded, taken from sampled_windows_.
+  vector<std::pair<vector<float>, bool> > batch_windows_;
+  shared_ptr<ThreadPool> window_pool_;
+  // Decoded images, if window_data_param.cache_bytes > 0.
+  shared_ptr<ImageCache> image_cache_;
 };
 
 }  // namespace caffe
@@ -87,6 +87,20 @@ class DataTransformer {
    */
   void Transform(Blob<Dtype>* input_blob, Blob<Dtype>* transformed_blob);
 
+  /**
+   * @brief Crops and mirrors uint8 data like Transform, but keeps the pixels
+   * as bytes and leaves out the mean and scale, which are then up to the
+   * consumer of the bytes. Mean files cannot be deferred this way, since they
+   * are indexed by the position in the uncropped image.
+   *
+   * @param datum
+   *    Datum with uint8 data to be transformed.
+   * @param transformed_data
+   *    Destination of channels x height x width bytes, with the cropped size.
+   */
+  void TransformBytes(const Datum& datum, uint8_t* transformed_data);
+  void TransformBytes(const cv::Mat& cv_img, uint8_t* transformed_data);
+
  protected:
    /**
    * @brief Generates a random integer from Uniform({0, 1, ..., n-1}).
@@ -99,6 +113,14 @@ class DataTransformer {
   virtual int Rand(int n);
 
   void Transform(const Datum& datum, Dtype* transformed_data);
+  // Shared implementations of Transform and TransformBytes, which center and
+  // scale the data only if normalize is set.
+  template <typename OutType>
+  void TransformDatum(const Datum& datum, bool normalize,
+      OutType* transformed_data);
+  template <typename OutType>
+  void TransformMat(const cv::Mat& cv_img, bool normalize,
+      OutType* transformed_data);
   // Tranformation parameters
   TransformationParameter param_;
 
@@ -27,6 +27,13 @@ class InternalThread {
   /** Will not return until the internal thread has exited. */
   bool WaitForInternalThreadToExit();
 
+  /**
+   * Asks the thread to stop by interrupting it and waits for it to exit.
+   * A thread blocked at an interruption point (e.g. BlockingQueue::pop)
+   * is woken up by boost::thread_interrupted.
+   */
+  void StopInternalThread();
+
   bool is_started() const;
 
  protected:
@@ -34,6 +41,9 @@ class InternalThread {
       with the code you want your thread to run. */
   virtual void InternalThreadEntry() {}
 
+  /* Should be tested when running loops to exit when requested. */
+  bool must_stop();
+
   shared_ptr<boost::thread> thread_;
 };
 
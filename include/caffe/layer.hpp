@@ -263,6 +263,21 @@ class Layer {
     return true;
   }
 
+  /**
+   * @brief Returns true if the top blobs share the data of the first bottom
+   *        blob (see Blob::ShareData) rather than holding data of their own.
+   *
+   * Net then keeps the memory of the bottom alive for as long as the tops
+   * are in use when planning the memory of the blobs.
+   */
+  virtual inline bool TopsShareBottomData() const { return false; }
+  /**
+   * @brief Returns true if Backward makes the bottom blobs share the diff of
+   *        the first top blob (see Blob::ShareDiff) rather than computing a
+   *        diff of their own.
+   */
+  virtual inline bool BottomsShareTopDiff() const { return false; }
+
   /**
    * @brief Specifies whether the layer should compute gradients w.r.t. a
    *        parameter at a particular index given by param_id.
@@ -208,6 +208,28 @@ class Net {
 
   /// @brief Get misc parameters, e.g. the LR multiplier and weight decay.
   void GetLearningRateAndWeightDecay();
+  /**
+   * @brief Place the data of blobs whose lifetimes in the forward pass do not
+   *        overlap in the same memory, for plan_memory.
+   */
+  void PlanDataMemory(const NetParameter& param);
+  /**
+   * @brief Place the diffs of blobs whose lifetimes in the backward pass do
+   *        not overlap in the same memory, for plan_memory.
+   */
+  void PlanDiffMemory(const NetParameter& param);
+  /// @brief Helper for planning: the blobs that keep memory of their own.
+  vector<bool> BlobsToKeep(const NetParameter& param) const;
+  /**
+   * @brief Helper for planning: the memory of each blob, shared by the blobs
+   *        whose owners have lifetimes that do not overlap, or NULL for the
+   *        blobs left alone.
+   */
+  vector<shared_ptr<SyncedMemory> > PlanBlobMemory(const vector<int>& owner,
+      const vector<pair<int, int> >& lifetimes, const vector<bool>& keep,
+      const string& what) const;
+  /// @brief Point the blobs to their planned diffs, or back to their own.
+  void UsePlannedDiffs(bool planned);
 
   /// @brief The network name
   string name_;
@@ -255,6 +277,13 @@ class Net {
   size_t memory_used_;
   /// Whether to compute and display debug info for the net.
   bool debug_info_;
+  /// Whether the data of the blobs only lives through the forward pass.
+  bool data_memory_planned_;
+  /// The planned diff of each blob, if any, and for verify_memory_plan the
+  /// diff of its own.
+  vector<shared_ptr<SyncedMemory> > planned_diffs_;
+  vector<shared_ptr<SyncedMemory> > own_diffs_;
+  bool verify_memory_plan_;
 
   DISABLE_COPY_AND_ASSIGN(Net);
 };
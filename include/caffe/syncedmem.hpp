@@ -4,6 +4,7 @@
 #include <cstdlib>
 
 #include "caffe/common.hpp"
+#include "caffe/util/host_allocator.hpp"
 #include "caffe/util/math_functions.hpp"
 
 namespace caffe {
@@ -21,14 +22,16 @@ namespace caffe {
 // are constantly accessing them the memory pages almost always stays in
 // the physical memory (assuming we have large enough memory installed), and
 // does not seem to create a memory bottleneck here.
+//
+// The buffers come from the HostAllocator cache, which keeps freed buffers
+// for reuse by later allocations of a similar size.
 
 inline void CaffeMallocHost(void** ptr, size_t size) {
-  *ptr = malloc(size);
-  CHECK(*ptr) << "host allocation of size " << size << " failed";
+  *ptr = HostAllocator::Get().Allocate(size);
 }
 
-inline void CaffeFreeHost(void* ptr) {
-  free(ptr);
+inline void CaffeFreeHost(void* ptr, size_t size) {
+  HostAllocator::Get().Free(ptr, size);
 }
 
 
@@ -36,6 +39,9 @@ inline void CaffeFreeHost(void* ptr) {
  * @brief Manages memory allocation and synchronization between the host (CPU)
  *        and device (GPU).
  *
+ * Host memory it allocates itself is aligned to HostAllocator::kAlignment
+ * bytes; memory given by set_cpu_data keeps the alignment it has.
+ *
  * TODO(dox): more thorough description.
  */
 class SyncedMemory {
@@ -52,6 +58,10 @@ class SyncedMemory {
   const void* gpu_data();
   void* mutable_cpu_data();
   void* mutable_gpu_data();
+  // Like mutable_cpu_data, for callers that overwrite all of the memory
+  // before reading any of it: new memory is not zero-filled, and data at the
+  // GPU is not copied back.
+  void* write_only_cpu_data();
   enum SyncedHead { UNINITIALIZED, HEAD_AT_CPU, HEAD_AT_GPU, SYNCED };
   SyncedHead head() { return head_; }
   size_t size() { return size_; }
@@ -0,0 +1,54 @@
+#ifndef CAFFE_UTIL_BLOCKING_QUEUE_HPP_
+#define CAFFE_UTIL_BLOCKING_QUEUE_HPP_
+
+#include <queue>
+#include <string>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief A thread-safe FIFO queue whose pop blocks until an element is
+ *        available. Used to hand buffers between a producer (e.g. a prefetch
+ *        thread) and a consumer (e.g. Forward).
+ *
+ * Blocking calls are boost interruption points, so a thread waiting on the
+ * queue is woken up by InternalThread::StopInternalThread.
+ */
+template <typename T>
+class BlockingQueue {
+ public:
+  BlockingQueue();
+
+  void push(const T& t);
+
+  bool try_pop(T* t);
+
+  // Logs log_on_wait (if not empty) when the caller has to block,
+  // which is useful to detect e.g. when data feeding is too slow.
+  T pop(const string& log_on_wait = "");
+
+  bool try_peek(T* t);
+
+  // Returns the front element without removing it.
+  T peek();
+
+  size_t size() const;
+
+ protected:
+  /**
+   Move synchronization fields out instead of including boost/thread.hpp
+   to avoid a boost/NVCC issues (#1009, #1010) on OSX.
+   */
+  class sync;
+
+  std::queue<T> queue_;
+  shared_ptr<sync> sync_;
+
+  DISABLE_COPY_AND_ASSIGN(BlockingQueue);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_BLOCKING_QUEUE_HPP_
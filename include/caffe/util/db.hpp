@@ -1,7 +1,11 @@
 #ifndef CAFFE_UTIL_DB_HPP
 #define CAFFE_UTIL_DB_HPP
 
+#include <stdint.h>
+
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "leveldb/db.h"
 #include "leveldb/write_batch.h"
@@ -20,8 +24,17 @@ class Cursor {
   virtual ~Cursor() { }
   virtual void SeekToFirst() = 0;
   virtual void Next() = 0;
+  // Moves to the record with the given key. Returns whether it exists.
+  virtual bool Seek(const string& key) = 0;
   virtual string key() = 0;
-  virtual string value() = 0;
+  // Copies the current value out of the database.
+  virtual string value() {
+    return string(static_cast<const char*>(value_data()), value_size());
+  }
+  // View of the current value in the database's own memory, without a copy.
+  // It is only valid until the cursor is moved or destroyed.
+  virtual const void* value_data() = 0;
+  virtual size_t value_size() = 0;
   virtual bool valid() = 0;
 
   DISABLE_COPY_AND_ASSIGN(Cursor);
@@ -45,10 +58,73 @@ class DB {
   virtual void Close() = 0;
   virtual Cursor* NewCursor() = 0;
   virtual Transaction* NewTransaction() = 0;
+  // Promises that the following transactions put keys in strictly increasing
+  // order, and after any existing key, so they can be appended in bulk.
+  virtual void set_sorted_writes(bool sorted) { }
 
   DISABLE_COPY_AND_ASSIGN(DB);
 };
 
+// Visits the given keys of another cursor, which must be a contiguous run of
+// its records in cursor order. It seeks to the first key and then steps with
+// Next, so that readers of disjoint runs only touch their own records.
+// Takes ownership of the wrapped cursor.
+class ShardCursor : public Cursor {
+ public:
+  ShardCursor(Cursor* cursor, const vector<string>& keys);
+  virtual ~ShardCursor() { delete cursor_; }
+  virtual void SeekToFirst();
+  virtual void Next();
+  // Only finds the keys of the run, and continues from the one found.
+  virtual bool Seek(const string& key);
+  virtual string key() { return cursor_->key(); }
+  virtual const void* value_data() { return cursor_->value_data(); }
+  virtual size_t value_size() { return cursor_->value_size(); }
+  virtual bool valid() { return pos_ < keys_.size() && cursor_->valid(); }
+
+ private:
+  Cursor* cursor_;
+  vector<string> keys_;
+  // Indices of keys_ in key order, to Seek by binary search.
+  vector<int> sorted_;
+  size_t pos_;
+};
+
+// Visits the given keys of another cursor by random access, in a fresh
+// random order on each pass from SeekToFirst. With block_size > 0 only the
+// order of runs of block_size consecutive keys is permuted, and the keys of
+// each run are shuffled among themselves, so that reads stay local to a part
+// of the database at a time. Takes ownership of the wrapped cursor.
+class ShuffleCursor : public Cursor {
+ public:
+  ShuffleCursor(Cursor* cursor, const vector<string>& keys, int block_size,
+      unsigned int seed);
+  virtual ~ShuffleCursor() { delete cursor_; }
+  virtual void SeekToFirst();
+  virtual void Next();
+  // Only finds the given keys, and continues the pass from the one found.
+  virtual bool Seek(const string& key);
+  virtual string key() { return cursor_->key(); }
+  virtual const void* value_data() { return cursor_->value_data(); }
+  virtual size_t value_size() { return cursor_->value_size(); }
+  virtual bool valid() { return pos_ < order_.size() && cursor_->valid(); }
+
+ private:
+  void Shuffle();
+  void SeekCurrent();
+
+  Cursor* cursor_;
+  vector<string> keys_;
+  int block_size_;
+  shared_ptr<Caffe::RNG> rng_;
+  // Indices of keys_ in key order, to Seek by binary search.
+  vector<int> sorted_;
+  vector<int> order_;
+  // The inverse of order_: the position in the pass of each key.
+  vector<int> position_;
+  size_t pos_;
+};
+
 class LevelDBCursor : public Cursor {
  public:
   explicit LevelDBCursor(leveldb::Iterator* iter)
@@ -56,8 +132,13 @@ class LevelDBCursor : public Cursor {
   ~LevelDBCursor() { delete iter_; }
   virtual void SeekToFirst() { iter_->SeekToFirst(); }
   virtual void Next() { iter_->Next(); }
+  virtual bool Seek(const string& key) {
+    iter_->Seek(key);
+    return iter_->Valid() && iter_->key().compare(key) == 0;
+  }
   virtual string key() { return iter_->key().ToString(); }
-  virtual string value() { return iter_->value().ToString(); }
+  virtual const void* value_data() { return iter_->value().data(); }
+  virtual size_t value_size() { return iter_->value().size(); }
   virtual bool valid() { return iter_->Valid(); }
 
  private:
@@ -121,13 +202,17 @@ class LMDBCursor : public Cursor {
   }
   virtual void SeekToFirst() { Seek(MDB_FIRST); }
   virtual void Next() { Seek(MDB_NEXT); }
+  virtual bool Seek(const string& key) {
+    mdb_key_.mv_data = const_cast<char*>(key.data());
+    mdb_key_.mv_size = key.size();
+    Seek(MDB_SET_KEY);
+    return valid_;
+  }
   virtual string key() {
     return string(static_cast<const char*>(mdb_key_.mv_data), mdb_key_.mv_size);
   }
-  virtual string value() {
-    return string(static_cast<const char*>(mdb_value_.mv_data),
-        mdb_value_.mv_size);
-  }
+  virtual const void* value_data() { return mdb_value_.mv_data; }
+  virtual size_t value_size() { return mdb_value_.mv_size; }
   virtual bool valid() { return valid_; }
 
  private:
@@ -149,21 +234,23 @@ class LMDBCursor : public Cursor {
 
 class LMDBTransaction : public Transaction {
  public:
-  explicit LMDBTransaction(MDB_dbi* mdb_dbi, MDB_txn* mdb_txn)
-    : mdb_dbi_(mdb_dbi), mdb_txn_(mdb_txn) { }
+  explicit LMDBTransaction(MDB_dbi* mdb_dbi, MDB_txn* mdb_txn,
+      unsigned int put_flags)
+    : mdb_dbi_(mdb_dbi), mdb_txn_(mdb_txn), put_flags_(put_flags) { }
   virtual void Put(const string& key, const string& value);
   virtual void Commit() { MDB_CHECK(mdb_txn_commit(mdb_txn_)); }
 
  private:
   MDB_dbi* mdb_dbi_;
   MDB_txn* mdb_txn_;
+  unsigned int put_flags_;
 
   DISABLE_COPY_AND_ASSIGN(LMDBTransaction);
 };
 
 class LMDB : public DB {
  public:
-  LMDB() : mdb_env_(NULL) { }
+  LMDB() : mdb_env_(NULL), put_flags_(0) { }
   virtual ~LMDB() { Close(); }
   virtual void Open(const string& source, Mode mode);
   virtual void Close() {
@@ -175,10 +262,99 @@ class LMDB : public DB {
   }
   virtual LMDBCursor* NewCursor();
   virtual LMDBTransaction* NewTransaction();
+  // Sorted keys are put with MDB_APPEND, which fills pages sequentially
+  // instead of searching the tree for each key.
+  virtual void set_sorted_writes(bool sorted) {
+    put_flags_ = sorted ? MDB_APPEND : 0;
+  }
 
  private:
   MDB_env* mdb_env_;
   MDB_dbi mdb_dbi_;
+  unsigned int put_flags_;
+};
+
+// A record file database is a directory of write-once shards. Each shard is
+// a data file of records, each a uint32 key size and value size followed by
+// the key and value bytes, and an index file of the uint64 offset of every
+// record. Shards are memory mapped for reading, and iterated in shard order,
+// then in the order the records were written.
+struct RecordShard {
+  const char* data;
+  size_t data_size;
+  const uint64_t* offsets;
+  size_t num_records;
+};
+
+// Positions of the records of a record file database sorted by key, shared
+// by its cursors and built on the first Seek.
+class RecordKeyIndex;
+
+class RecordCursor : public Cursor {
+ public:
+  RecordCursor(const vector<RecordShard>* shards, RecordKeyIndex* key_index)
+    : shards_(shards), key_index_(key_index) { SeekToFirst(); }
+  virtual void SeekToFirst();
+  virtual void Next();
+  virtual bool Seek(const string& key);
+  virtual string key() { return string(key_, key_size_); }
+  virtual const void* value_data() { return value_; }
+  virtual size_t value_size() { return value_size_; }
+  virtual bool valid() { return shard_ < shards_->size(); }
+
+ private:
+  // Moves to the first existing record at or after (shard_, record_),
+  // reading ahead when streaming.
+  void Settle(bool readahead);
+
+  const vector<RecordShard>* shards_;
+  RecordKeyIndex* key_index_;
+  size_t shard_, record_;
+  const char* key_;
+  const char* value_;
+  uint32_t key_size_, value_size_;
+  // End of the data already advised to be read ahead in the current shard.
+  uint64_t readahead_end_;
+};
+
+class RecordTransaction : public Transaction {
+ public:
+  explicit RecordTransaction(int data_fd, int index_fd, uint64_t* data_end)
+    : data_fd_(data_fd), index_fd_(index_fd), data_end_(data_end) { }
+  virtual void Put(const string& key, const string& value);
+  virtual void Commit();
+
+ private:
+  int data_fd_, index_fd_;
+  uint64_t* data_end_;
+  string data_;
+  vector<uint64_t> offsets_;
+
+  DISABLE_COPY_AND_ASSIGN(RecordTransaction);
+};
+
+// Opening for writing claims a new shard, so several writers, in one or more
+// processes, can fill the same database in parallel. Seeking requires the
+// keys to be unique across all writers.
+class RecordDB : public DB {
+ public:
+  RecordDB() : data_fd_(-1), index_fd_(-1), data_end_(0) { }
+  virtual ~RecordDB() { Close(); }
+  virtual void Open(const string& source, Mode mode);
+  virtual void Close();
+  virtual RecordCursor* NewCursor() {
+    return new RecordCursor(&shards_, key_index_.get());
+  }
+  virtual RecordTransaction* NewTransaction() {
+    CHECK_GE(data_fd_, 0) << "Record file database not opened for writing";
+    return new RecordTransaction(data_fd_, index_fd_, &data_end_);
+  }
+
+ private:
+  vector<RecordShard> shards_;
+  shared_ptr<RecordKeyIndex> key_index_;
+  int data_fd_, index_fd_;
+  uint64_t data_end_;
 };
 
 DB* GetDB(DataParameter::DB backend);
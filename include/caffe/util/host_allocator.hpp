@@ -0,0 +1,73 @@
+#ifndef CAFFE_UTIL_HOST_ALLOCATOR_HPP_
+#define CAFFE_UTIL_HOST_ALLOCATOR_HPP_
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief A thread-safe cache of host buffers behind CaffeMallocHost, so that
+ *        blobs reshaped between a few recurring sizes stop going back to
+ *        malloc, and faulting in fresh pages, once each size has been seen.
+ *
+ * Requests are rounded up to a size class, a multiple of a quarter of the
+ * largest power of two not above them, so a buffer is less than a quarter
+ * larger than asked for. Freed buffers are kept on a free list per class,
+ * up to cache_limit() bytes in total, until Trim returns them to the system.
+ *
+ * Buffers are aligned to kAlignment bytes. Those of at least
+ * huge_page_threshold() bytes are aligned to huge pages instead, and the
+ * kernel is asked to back them with transparent huge pages where supported.
+ */
+class HostAllocator {
+ public:
+  struct Stats {
+    Stats()
+        : allocations(0), cache_hits(0), bytes_in_use(0), bytes_cached(0) { }
+    // Buffers handed out, and how many of them came from a free list.
+    size_t allocations, cache_hits;
+    // Bytes of the buffers handed out and not freed yet, and of those kept
+    // on the free lists, counted by size class.
+    size_t bytes_in_use, bytes_cached;
+  };
+
+  // Alignment of all buffers, enough for aligned vector loads.
+  static const size_t kAlignment = 64;
+  static const size_t kHugePageSize = 2 << 20;
+
+  // The allocator of the process.
+  static HostAllocator& Get();
+
+  void* Allocate(size_t size);
+  // Takes back a buffer from Allocate, given the size it was asked for.
+  void Free(void* ptr, size_t size);
+  // Returns the buffers kept on the free lists to the system.
+  void Trim();
+
+  Stats stats() const;
+  size_t cache_limit() const;
+  void set_cache_limit(size_t bytes);
+  // Size from which buffers get huge pages, or 0 for never.
+  size_t huge_page_threshold() const;
+  void set_huge_page_threshold(size_t bytes);
+
+  // The size of the buffers allocated for requests of the given size.
+  static size_t ClassSize(size_t size);
+
+ protected:
+  HostAllocator();
+
+  /**
+   Move the free lists and their mutex out instead of including
+   boost/thread.hpp here, like BlockingQueue.
+   */
+  class sync;
+
+  shared_ptr<sync> sync_;
+
+  DISABLE_COPY_AND_ASSIGN(HostAllocator);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_HOST_ALLOCATOR_HPP_
@@ -0,0 +1,47 @@
+#ifndef CAFFE_UTIL_IMAGE_CACHE_HPP_
+#define CAFFE_UTIL_IMAGE_CACHE_HPP_
+
+#include <string>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief A thread-safe in-memory cache of decoded images, bounded by a byte
+ *        budget and evicting the least recently used images first.
+ *
+ * Cached images share their pixels with the callers of Put and Get, so they
+ * must be treated as read-only.
+ */
+class ImageCache {
+ public:
+  explicit ImageCache(size_t capacity);
+
+  // Returns whether the image for key is cached, and sets *image if so.
+  bool Get(const string& key, cv::Mat* image);
+  // Returns whether the image for key is cached, without marking it used.
+  bool Contains(const string& key) const;
+  // Caches image under key, unless it is larger than the whole budget.
+  void Put(const string& key, const cv::Mat& image);
+
+  inline size_t capacity() const { return capacity_; }
+  // Bytes of pixels currently cached.
+  size_t size() const;
+
+ protected:
+  /**
+   Move the containers and synchronization fields out instead of including
+   OpenCV and boost/thread.hpp here, like BlockingQueue.
+   */
+  class sync;
+
+  size_t capacity_;
+  shared_ptr<sync> sync_;
+
+  DISABLE_COPY_AND_ASSIGN(ImageCache);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_IMAGE_CACHE_HPP_
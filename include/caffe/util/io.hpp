@@ -3,6 +3,7 @@
 
 #include <unistd.h>
 #include <string>
+#include <vector>
 
 #include "google/protobuf/message.h"
 #include "hdf5.h"
@@ -91,6 +92,10 @@ inline bool ReadFileToDatum(const string& filename, Datum* datum) {
   return ReadFileToDatum(filename, -1, datum);
 }
 
+// Asks the kernel to start reading the file into the page cache in the
+// background, so that a later read of it does not wait on the disk.
+void ReadAheadFile(const string& filename);
+
 bool ReadImageToDatum(const string& filename, const int label,
     const int height, const int width, const bool is_color,
     const std::string & encoding, Datum* datum);
@@ -124,6 +129,13 @@ inline bool ReadImageToDatum(const string& filename, const int label,
 bool DecodeDatumNative(Datum* datum);
 bool DecodeDatum(Datum* datum, bool is_color);
 
+// Reads an image, resized to height x width if both are positive. With
+// reduced_decode a JPEG is first decoded at the smallest 1/2, 1/4 or 1/8
+// scale that still covers that size, which is faster but changes the pixels.
+cv::Mat ReadImageToCVMat(const string& filename,
+    const int height, const int width, const bool is_color,
+    const bool reduced_decode);
+
 cv::Mat ReadImageToCVMat(const string& filename,
     const int height, const int width, const bool is_color);
 
@@ -135,11 +147,34 @@ cv::Mat ReadImageToCVMat(const string& filename,
 
 cv::Mat ReadImageToCVMat(const string& filename);
 
+// Decodes an encoded image. A JPEG is decoded at a reduced scale when that
+// still covers min_height x min_width in either orientation, if both are
+// positive.
+cv::Mat DecodeImageToCVMat(const char* data, size_t size, bool is_color,
+    int min_height, int min_width);
+
 cv::Mat DecodeDatumToCVMatNative(const Datum& datum);
 cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color);
+cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color,
+    int min_height, int min_width);
 
 void CVMatToDatum(const cv::Mat& cv_img, Datum* datum);
 
+// Holds a process-wide lock on the HDF5 library for its lifetime, since the
+// library is usually built without thread safety and data layers call it
+// from their own threads.
+class HDF5Lock {
+ public:
+  HDF5Lock();
+  ~HDF5Lock();
+
+  DISABLE_COPY_AND_ASSIGN(HDF5Lock);
+};
+
+void hdf5_get_nd_dataset_shape(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    vector<int>* shape);
+
 template <typename Dtype>
 void hdf5_load_nd_dataset_helper(
     hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
@@ -150,10 +185,23 @@ void hdf5_load_nd_dataset(
     hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
     Blob<Dtype>* blob);
 
+// Loads num_rows rows of a dataset, starting at row_offset along its first
+// axis, without reading the rest of it.
+template <typename Dtype>
+void hdf5_load_nd_dataset_rows(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    int row_offset, int num_rows, Blob<Dtype>* blob);
+
 template <typename Dtype>
 void hdf5_save_nd_dataset(
     const hid_t file_id, const string& dataset_name, const Blob<Dtype>& blob);
 
+// Appends the rows of blob to a dataset, creating it on the first call as
+// a chunked dataset of unlimited rows.
+template <typename Dtype>
+void hdf5_append_nd_dataset(
+    const hid_t file_id, const string& dataset_name, const Blob<Dtype>& blob);
+
 }  // namespace caffe
 
 #endif   // CAFFE_UTIL_IO_H_
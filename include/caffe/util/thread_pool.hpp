@@ -0,0 +1,45 @@
+#ifndef CAFFE_UTIL_THREAD_POOL_HPP_
+#define CAFFE_UTIL_THREAD_POOL_HPP_
+
+#include <boost/function.hpp>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/blocking_queue.hpp"
+
+namespace caffe {
+
+/**
+ * @brief A fixed set of long-lived threads that run the same job once per
+ *        worker, e.g. to process disjoint slots of a batch in parallel.
+ *
+ * The thread calling Run acts as worker 0, so a pool of size 1 runs the
+ * job inline and starts no thread at all.
+ */
+class ThreadPool {
+ public:
+  explicit ThreadPool(int size);
+  ~ThreadPool();
+
+  inline int size() const { return size_; }
+
+  /**
+   * @brief Calls job(worker_id) for every worker_id in [0, size()) and
+   *        returns once all of them have finished.
+   */
+  void Run(const boost::function<void(int)>& job);
+
+ protected:
+  class Worker;
+
+  int size_;
+  vector<shared_ptr<Worker> > workers_;
+  const boost::function<void(int)>* job_;
+  BlockingQueue<int> done_;
+
+  DISABLE_COPY_AND_ASSIGN(ThreadPool);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_THREAD_POOL_HPP_
@@ -102,6 +102,12 @@ Dtype* Blob<Dtype>::mutable_cpu_data() {
   return static_cast<Dtype*>(data_->mutable_cpu_data());
 }
 
+template <typename Dtype>
+Dtype* Blob<Dtype>::write_only_cpu_data() {
+  CHECK(data_);
+  return static_cast<Dtype*>(data_->write_only_cpu_data());
+}
+
 template <typename Dtype>
 Dtype* Blob<Dtype>::mutable_gpu_data() {
   CHECK(data_);
@@ -132,6 +138,21 @@ void Blob<Dtype>::ShareDiff(const Blob& other) {
   diff_ = other.diff();
 }
 
+template <typename Dtype>
+void Blob<Dtype>::ShareDataMemory(const shared_ptr<SyncedMemory>& data) {
+  CHECK_GE(data->size(), count_ * sizeof(Dtype));
+  // Reshape must not grow the Blob past the shared memory in place.
+  capacity_ = count_;
+  data_ = data;
+}
+
+template <typename Dtype>
+void Blob<Dtype>::ShareDiffMemory(const shared_ptr<SyncedMemory>& diff) {
+  CHECK_GE(diff->size(), count_ * sizeof(Dtype));
+  capacity_ = count_;
+  diff_ = diff;
+}
+
 // The "update" method is used for parameter blobs in a Net, which are stored
 // as Blob<float> or Blob<double> -- hence we do not define it for
 // Blob<int> or Blob<unsigned int>.
@@ -34,20 +34,68 @@ DataTransformer<Dtype>::DataTransformer(const TransformationParameter& param,
   }
 }
 
+// Converts, centers and scales one row of pixels into dst, which is the
+// inner loop of every transform. The mean is either a row of mean (when not
+// NULL) or mean_value. Each case is a plain branch-free loop, so that the
+// compiler can vectorize it.
+template <typename Dtype, typename SrcType, typename OutType>
+static void TransformRow(const SrcType* src, int src_stride,
+    const Dtype* mean, Dtype mean_value, Dtype scale, bool mirror, int width,
+    OutType* dst) {
+  if (mirror) {
+    dst += width - 1;
+    if (mean) {
+      for (int w = 0; w < width; ++w) {
+        dst[-w] = (static_cast<Dtype>(src[w * src_stride]) - mean[w]) * scale;
+      }
+    } else {
+      for (int w = 0; w < width; ++w) {
+        dst[-w] = (static_cast<Dtype>(src[w * src_stride]) - mean_value)
+            * scale;
+      }
+    }
+  } else {
+    if (mean) {
+      for (int w = 0; w < width; ++w) {
+        dst[w] = (static_cast<Dtype>(src[w * src_stride]) - mean[w]) * scale;
+      }
+    } else {
+      for (int w = 0; w < width; ++w) {
+        dst[w] = (static_cast<Dtype>(src[w * src_stride]) - mean_value)
+            * scale;
+      }
+    }
+  }
+}
+
 template<typename Dtype>
 void DataTransformer<Dtype>::Transform(const Datum& datum,
                                        Dtype* transformed_data) {
+  TransformDatum(datum, true, transformed_data);
+}
+
+template<typename Dtype>
+void DataTransformer<Dtype>::TransformBytes(const Datum& datum,
+                                            uint8_t* transformed_data) {
+  CHECK_GT(datum.data().size(), 0) << "Only uint8 data can be kept as bytes";
+  TransformDatum(datum, false, transformed_data);
+}
+
+template<typename Dtype>
+template<typename OutType>
+void DataTransformer<Dtype>::TransformDatum(const Datum& datum,
+    bool normalize, OutType* transformed_data) {
   const string& data = datum.data();
   const int datum_channels = datum.channels();
   const int datum_height = datum.height();
   const int datum_width = datum.width();
 
   const int crop_size = param_.crop_size();
-  const Dtype scale = param_.scale();
+  const Dtype scale = normalize ? param_.scale() : Dtype(1);
   const bool do_mirror = param_.mirror() && Rand(2);
-  const bool has_mean_file = param_.has_mean_file();
+  const bool has_mean_file = normalize && param_.has_mean_file();
   const bool has_uint8 = data.size() > 0;
-  const bool has_mean_values = mean_values_.size() > 0;
+  const bool has_mean_values = normalize && mean_values_.size() > 0;
 
   CHECK_GT(datum_channels, 0);
   CHECK_GE(datum_height, crop_size);
@@ -89,34 +137,21 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
     }
   }
 
-  Dtype datum_element;
-  int top_index, data_index;
+  const uint8_t* uint8_data = reinterpret_cast<const uint8_t*>(data.data());
+  const float* float_data = datum.float_data().data();
   for (int c = 0; c < datum_channels; ++c) {
+    const Dtype mean_value = has_mean_values ? mean_values_[c] : Dtype(0);
     for (int h = 0; h < height; ++h) {
-      for (int w = 0; w < width; ++w) {
-        data_index = (c * datum_height + h_off + h) * datum_width + w_off + w;
-        if (do_mirror) {
-          top_index = (c * height + h) * width + (width - 1 - w);
-        } else {
-          top_index = (c * height + h) * width + w;
-        }
-        if (has_uint8) {
-          datum_element =
-            static_cast<Dtype>(static_cast<uint8_t>(data[data_index]));
-        } else {
-          datum_element = datum.float_data(data_index);
-        }
-        if (has_mean_file) {
-          transformed_data[top_index] =
-            (datum_element - mean[data_index]) * scale;
-        } else {
-          if (has_mean_values) {
-            transformed_data[top_index] =
-              (datum_element - mean_values_[c]) * scale;
-          } else {
-            transformed_data[top_index] = datum_element * scale;
-          }
-        }
+      const int data_index = (c * datum_height + h_off + h) * datum_width
+          + w_off;
+      const Dtype* mean_row = has_mean_file ? mean + data_index : NULL;
+      OutType* top_row = transformed_data + (c * height + h) * width;
+      if (has_uint8) {
+        TransformRow(uint8_data + data_index, 1, mean_row, mean_value, scale,
+            do_mirror, width, top_row);
+      } else {
+        TransformRow(float_data + data_index, 1, mean_row, mean_value, scale,
+            do_mirror, width, top_row);
       }
     }
   }
@@ -210,13 +245,38 @@ void DataTransformer<Dtype>::Transform(const cv::Mat& cv_img,
   CHECK_LE(width, img_width);
   CHECK_GE(num, 1);
 
+  const int crop_size = param_.crop_size();
+  if (crop_size) {
+    CHECK_EQ(crop_size, height);
+    CHECK_EQ(crop_size, width);
+  } else {
+    CHECK_EQ(img_height, height);
+    CHECK_EQ(img_width, width);
+  }
+  TransformMat(cv_img, true, transformed_blob->mutable_cpu_data());
+}
+
+template<typename Dtype>
+void DataTransformer<Dtype>::TransformBytes(const cv::Mat& cv_img,
+                                            uint8_t* transformed_data) {
+  TransformMat(cv_img, false, transformed_data);
+}
+
+template<typename Dtype>
+template<typename OutType>
+void DataTransformer<Dtype>::TransformMat(const cv::Mat& cv_img,
+    bool normalize, OutType* transformed_data) {
+  const int img_channels = cv_img.channels();
+  const int img_height = cv_img.rows;
+  const int img_width = cv_img.cols;
+
   CHECK(cv_img.depth() == CV_8U) << "Image data type must be unsigned byte";
 
   const int crop_size = param_.crop_size();
-  const Dtype scale = param_.scale();
+  const Dtype scale = normalize ? param_.scale() : Dtype(1);
   const bool do_mirror = param_.mirror() && Rand(2);
-  const bool has_mean_file = param_.has_mean_file();
-  const bool has_mean_values = mean_values_.size() > 0;
+  const bool has_mean_file = normalize && param_.has_mean_file();
+  const bool has_mean_values = normalize && mean_values_.size() > 0;
 
   CHECK_GT(img_channels, 0);
   CHECK_GE(img_height, crop_size);
@@ -240,12 +300,14 @@ void DataTransformer<Dtype>::Transform(const cv::Mat& cv_img,
     }
   }
 
+  int height = img_height;
+  int width = img_width;
   int h_off = 0;
   int w_off = 0;
   cv::Mat cv_cropped_img = cv_img;
   if (crop_size) {
-    CHECK_EQ(crop_size, height);
-    CHECK_EQ(crop_size, width);
+    height = crop_size;
+    width = crop_size;
     // We only do random crop when we do training.
     if (phase_ == TRAIN) {
       h_off = Rand(img_height - crop_size + 1);
@@ -256,40 +318,19 @@ void DataTransformer<Dtype>::Transform(const cv::Mat& cv_img,
     }
     cv::Rect roi(w_off, h_off, crop_size, crop_size);
     cv_cropped_img = cv_img(roi);
-  } else {
-    CHECK_EQ(img_height, height);
-    CHECK_EQ(img_width, width);
   }
 
   CHECK(cv_cropped_img.data);
 
-  Dtype* transformed_data = transformed_blob->mutable_cpu_data();
-  int top_index;
+  // The image is interleaved, so each channel of a row is read with a stride.
   for (int h = 0; h < height; ++h) {
     const uchar* ptr = cv_cropped_img.ptr<uchar>(h);
-    int img_index = 0;
-    for (int w = 0; w < width; ++w) {
-      for (int c = 0; c < img_channels; ++c) {
-        if (do_mirror) {
-          top_index = (c * height + h) * width + (width - 1 - w);
-        } else {
-          top_index = (c * height + h) * width + w;
-        }
-        // int top_index = (c * height + h) * width + w;
-        Dtype pixel = static_cast<Dtype>(ptr[img_index++]);
-        if (has_mean_file) {
-          int mean_index = (c * img_height + h_off + h) * img_width + w_off + w;
-          transformed_data[top_index] =
-            (pixel - mean[mean_index]) * scale;
-        } else {
-          if (has_mean_values) {
-            transformed_data[top_index] =
-              (pixel - mean_values_[c]) * scale;
-          } else {
-            transformed_data[top_index] = pixel * scale;
-          }
-        }
-      }
+    for (int c = 0; c < img_channels; ++c) {
+      const Dtype mean_value = has_mean_values ? mean_values_[c] : Dtype(0);
+      const Dtype* mean_row = has_mean_file ?
+          mean + (c * img_height + h_off + h) * img_width + w_off : NULL;
+      TransformRow(ptr + c, img_channels, mean_row, mean_value, scale,
+          do_mirror, width, transformed_data + (c * height + h) * width);
     }
   }
 }
@@ -4,13 +4,17 @@
 namespace caffe {
 
 InternalThread::~InternalThread() {
-  WaitForInternalThreadToExit();
+  StopInternalThread();
 }
 
 bool InternalThread::is_started() const {
   return thread_.get() != NULL && thread_->joinable();
 }
 
+bool InternalThread::must_stop() {
+  return thread_.get() != NULL && thread_->interruption_requested();
+}
+
 
 bool InternalThread::StartInternalThread() {
   if (!WaitForInternalThreadToExit()) {
@@ -37,4 +41,16 @@ bool InternalThread::WaitForInternalThreadToExit() {
   return true;
 }
 
+void InternalThread::StopInternalThread() {
+  if (is_started()) {
+    thread_->interrupt();
+    try {
+      thread_->join();
+    } catch (boost::thread_interrupted&) {
+    } catch (std::exception& e) {
+      LOG(FATAL) << "Thread exception: " << e.what();
+    }
+  }
+}
+
 }  // namespace caffe
@@ -161,7 +161,7 @@ void BaseConvolutionLayer<Dtype>::forward_cpu_gemm(const Dtype* input,
   const Dtype* col_buff = input;
   if (!is_1x1_) {
     if (!skip_im2col) {
-      conv_im2col_cpu(input, col_buffer_.mutable_cpu_data());
+      conv_im2col_cpu(input, col_buffer_.write_only_cpu_data());
     }
     col_buff = col_buffer_.cpu_data();
   }
@@ -184,7 +184,7 @@ void BaseConvolutionLayer<Dtype>::forward_cpu_bias(Dtype* output,
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::backward_cpu_gemm(const Dtype* output,
     const Dtype* weights, Dtype* input) {
-  Dtype* col_buff = col_buffer_.mutable_cpu_data();
+  Dtype* col_buff = col_buffer_.write_only_cpu_data();
   if (is_1x1_) {
     col_buff = input;
   }
@@ -204,7 +204,7 @@ void BaseConvolutionLayer<Dtype>::weight_cpu_gemm(const Dtype* input,
     const Dtype* output, Dtype* weights) {
   const Dtype* col_buff = input;
   if (!is_1x1_) {
-    conv_im2col_cpu(input, col_buffer_.mutable_cpu_data());
+    conv_im2col_cpu(input, col_buffer_.write_only_cpu_data());
     col_buff = col_buffer_.cpu_data();
   }
   for (int g = 0; g < group_; ++g) {
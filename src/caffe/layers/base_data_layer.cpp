@@ -1,8 +1,10 @@
+#include <boost/thread.hpp>
 #include <string>
 #include <vector>
 
 #include "caffe/data_layers.hpp"
 #include "caffe/net.hpp"
+#include "caffe/util/benchmark.hpp"
 #include "caffe/util/io.hpp"
 
 namespace caffe {
@@ -28,54 +30,142 @@ void BaseDataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
   data_transformer_->InitRand();
 }
 
+template <typename Dtype>
+BasePrefetchingDataLayer<Dtype>::BasePrefetchingDataLayer(
+    const LayerParameter& param)
+    : BaseDataLayer<Dtype>(param),
+      prefetch_(param.data_param().prefetch()),
+      prefetch_current_(NULL),
+      bytes_scale_(1) {
+  CHECK_GT(prefetch_.size(), 0) << "At least one batch must be prefetched.";
+  for (int i = 0; i < prefetch_.size(); ++i) {
+    prefetch_[i].reset(new Batch<Dtype>());
+    prefetch_free_.push(prefetch_[i].get());
+  }
+}
+
 template <typename Dtype>
 void BasePrefetchingDataLayer<Dtype>::LayerSetUp(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  // The prefetch thread runs until interrupted, so a repeated SetUp has to
+  // stop it before the subclass reshapes the batches, and then hand every
+  // batch back to the free queue, including any loaded or in use.
+  StopInternalThread();
+  Batch<Dtype>* batch;
+  while (prefetch_full_.try_pop(&batch)) {}
+  while (prefetch_free_.try_pop(&batch)) {}
+  prefetch_current_ = NULL;
+  for (int i = 0; i < prefetch_.size(); ++i) {
+    prefetch_free_.push(prefetch_[i].get());
+  }
   BaseDataLayer<Dtype>::LayerSetUp(bottom, top);
-  // Now, start the prefetch thread. Before calling prefetch, we make two
-  // cpu_data calls so that the prefetch thread does not accidentally make
-  // simultaneous cudaMalloc calls when the main thread is running. In some
-  // GPUs this seems to cause failures if we do not so.
-  this->prefetch_data_.mutable_cpu_data();
-  if (this->output_labels_) {
-    this->prefetch_label_.mutable_cpu_data();
+  // Before starting the prefetch thread, we make cpu_data calls so that the
+  // prefetch thread does not accidentally make simultaneous cudaMalloc calls
+  // when the main thread is running. In some GPUs this seems to cause failures
+  // if we do not so.
+  for (int i = 0; i < prefetch_.size(); ++i) {
+    if (prefetch_[i]->bytes_) {
+      prefetch_[i]->bytes_->write_only_cpu_data();
+    } else {
+      prefetch_[i]->data_.write_only_cpu_data();
+    }
+    if (this->output_labels_) {
+      prefetch_[i]->label_.write_only_cpu_data();
+    }
+    for (int j = 0; j < prefetch_[i]->extra_.size(); ++j) {
+      prefetch_[i]->extra_[j]->write_only_cpu_data();
+    }
   }
   DLOG(INFO) << "Initializing prefetch";
-  this->CreatePrefetchThread();
+  CHECK(!is_started()) << "Prefetch thread is still running";
+  CHECK(StartInternalThread()) << "Thread execution failed";
   DLOG(INFO) << "Prefetch initialized.";
 }
 
 template <typename Dtype>
-void BasePrefetchingDataLayer<Dtype>::CreatePrefetchThread() {
-  this->data_transformer_->InitRand();
-  CHECK(StartInternalThread()) << "Thread execution failed";
+void BasePrefetchingDataLayer<Dtype>::InternalThreadEntry() {
+  CPUTimer timer;
+  try {
+    while (!must_stop()) {
+      timer.Start();
+      Batch<Dtype>* batch = prefetch_free_.pop();
+      batch->stats_ = PrefetchStats();
+      batch->stats_.batches = 1;
+      batch->stats_.free_wait_time = timer.MicroSeconds();
+      timer.Start();
+      LoadBatch(batch);
+      batch->stats_.load_time = timer.MicroSeconds();
+      prefetch_full_.push(batch);
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
 }
 
 template <typename Dtype>
-void BasePrefetchingDataLayer<Dtype>::JoinPrefetchThread() {
-  CHECK(WaitForInternalThreadToExit()) << "Thread joining failed";
+void BasePrefetchingDataLayer<Dtype>::NextBatch() {
+  // The previous batch is no longer referenced by the top blobs once they
+  // are pointed at the new one, so hand it back to the prefetch thread.
+  if (prefetch_current_) {
+    prefetch_free_.push(prefetch_current_);
+  }
+  CPUTimer timer;
+  timer.Start();
+  prefetch_current_ = prefetch_full_.pop("Data layer prefetch queue empty");
+  stats_.forward_wait_time += timer.MicroSeconds();
+  stats_.Add(prefetch_current_->stats_);
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::LogStats() const {
+  if (stats_.batches == 0) {
+    return;
+  }
+  const double ms_per_batch = 1000. * stats_.batches;
+  LOG(INFO) << "    " << this->layer_param_.name() << " prefetch per batch: "
+      << "load " << stats_.load_time / ms_per_batch << " ms (read "
+      << stats_.read_time / ms_per_batch << " ms, transform "
+      << stats_.transform_time / ms_per_batch << " ms), wait for free "
+      << stats_.free_wait_time / ms_per_batch << " ms, Forward wait "
+      << stats_.forward_wait_time / ms_per_batch << " ms.";
 }
 
 template <typename Dtype>
 void BasePrefetchingDataLayer<Dtype>::Forward_cpu(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  // First, join the thread
-  JoinPrefetchThread();
-  DLOG(INFO) << "Thread joined";
-  // Reshape to loaded data.
-  top[0]->Reshape(this->prefetch_data_.num(), this->prefetch_data_.channels(),
-      this->prefetch_data_.height(), this->prefetch_data_.width());
-  // Copy the data
-  caffe_copy(prefetch_data_.count(), prefetch_data_.cpu_data(),
-             top[0]->mutable_cpu_data());
-  DLOG(INFO) << "Prefetch copied";
+  NextBatch();
+  top[0]->ReshapeLike(prefetch_current_->data_);
+  if (prefetch_current_->bytes_) {
+    // Center and scale the bytes into the top blob.
+    const uint8_t* bytes =
+        static_cast<const uint8_t*>(prefetch_current_->bytes_->cpu_data());
+    const Dtype* mean = bytes_mean_.cpu_data();
+    const int channels = top[0]->channels();
+    const int spatial_dim = top[0]->count(2);
+    Dtype* top_data = top[0]->mutable_cpu_data();
+    for (int i = 0; i < top[0]->count(0, 2); ++i) {
+      const Dtype mean_value = mean[i % channels];
+      for (int j = 0; j < spatial_dim; ++j) {
+        top_data[j] = (static_cast<Dtype>(bytes[j]) - mean_value)
+            * bytes_scale_;
+      }
+      bytes += spatial_dim;
+      top_data += spatial_dim;
+    }
+  } else {
+    // Share the loaded data instead of copying it.
+    top[0]->ShareDataMemory(prefetch_current_->data_.data());
+  }
+  DLOG(INFO) << "Prefetch shared";
   if (this->output_labels_) {
-    caffe_copy(prefetch_label_.count(), prefetch_label_.cpu_data(),
-               top[1]->mutable_cpu_data());
+    top[1]->ReshapeLike(prefetch_current_->label_);
+    top[1]->ShareDataMemory(prefetch_current_->label_.data());
+  }
+  for (int i = 0; i < prefetch_current_->extra_.size(); ++i) {
+    Blob<Dtype>* extra = prefetch_current_->extra_[i].get();
+    top[i + 2]->ReshapeLike(*extra);
+    top[i + 2]->ShareDataMemory(extra->data());
   }
-  // Start a new prefetch thread
-  DLOG(INFO) << "CreatePrefetchThread";
-  CreatePrefetchThread();
 }
 
 #ifdef CPU_ONLY
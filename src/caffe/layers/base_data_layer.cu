@@ -4,23 +4,49 @@
 
 namespace caffe {
 
+template <typename Dtype>
+__global__ void CenterAndScaleBytes(const int n, const uint8_t* bytes,
+    const Dtype* mean, const Dtype scale, const int channels,
+    const int spatial_dim, Dtype* out) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int c = (index / spatial_dim) % channels;
+    out[index] = (static_cast<Dtype>(bytes[index]) - mean[c]) * scale;
+  }
+}
+
 template <typename Dtype>
 void BasePrefetchingDataLayer<Dtype>::Forward_gpu(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  // First, join the thread
-  JoinPrefetchThread();
-  // Reshape to loaded data.
-  top[0]->Reshape(this->prefetch_data_.num(), this->prefetch_data_.channels(),
-      this->prefetch_data_.height(), this->prefetch_data_.width());
-  // Copy the data
-  caffe_copy(prefetch_data_.count(), prefetch_data_.cpu_data(),
-      top[0]->mutable_gpu_data());
+  NextBatch();
+  top[0]->ReshapeLike(prefetch_current_->data_);
+  if (prefetch_current_->bytes_) {
+    // Transfer the bytes, and center and scale them on the device.
+    const int count = top[0]->count();
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    CenterAndScaleBytes<Dtype><<<CAFFE_GET_BLOCKS(count),
+        CAFFE_CUDA_NUM_THREADS>>>(count,
+        static_cast<const uint8_t*>(prefetch_current_->bytes_->gpu_data()),
+        bytes_mean_.gpu_data(), bytes_scale_, top[0]->channels(),
+        top[0]->count(2), top[0]->mutable_gpu_data());
+    CUDA_POST_KERNEL_CHECK;
+  } else {
+    // Share the loaded data instead of copying it; the top blob keeps the
+    // memory of the batch, and its device copy, until the next Forward.
+    top[0]->ShareDataMemory(prefetch_current_->data_.data());
+    // Transfer the batch to the device
+    top[0]->gpu_data();
+  }
   if (this->output_labels_) {
-    caffe_copy(prefetch_label_.count(), prefetch_label_.cpu_data(),
-        top[1]->mutable_gpu_data());
+    top[1]->ReshapeLike(prefetch_current_->label_);
+    top[1]->ShareDataMemory(prefetch_current_->label_.data());
+    top[1]->gpu_data();
+  }
+  for (int i = 0; i < prefetch_current_->extra_.size(); ++i) {
+    Blob<Dtype>* extra = prefetch_current_->extra_[i].get();
+    top[i + 2]->ReshapeLike(*extra);
+    top[i + 2]->ShareDataMemory(extra->data());
+    top[i + 2]->gpu_data();
   }
-  // Start a new prefetch thread
-  CreatePrefetchThread();
 }
 
 INSTANTIATE_LAYER_GPU_FORWARD(BasePrefetchingDataLayer);
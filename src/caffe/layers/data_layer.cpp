@@ -1,7 +1,12 @@
+#include <boost/bind.hpp>
 #include <opencv2/core/core.hpp>
 
 #include <stdint.h>
+#include <unistd.h>
 
+#include <cstdio>
+#include <fstream>  // NOLINT(readability/streams)
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -13,34 +18,86 @@
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
+#include "caffe/util/thread_pool.hpp"
 
 namespace caffe {
 
 template <typename Dtype>
 DataLayer<Dtype>::~DataLayer<Dtype>() {
-  this->JoinPrefetchThread();
+  this->StopInternalThread();
+  // The decode workers use the cursor and transformers, so stop them first.
+  decode_pool_.reset();
 }
 
 template <typename Dtype>
 void DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   // Initialize DB
-  db_.reset(db::GetDB(this->layer_param_.data_param().backend()));
-  db_->Open(this->layer_param_.data_param().source(), db::READ);
-  cursor_.reset(db_->NewCursor());
-
+  const DataParameter& data_param = this->layer_param_.data_param();
+  // On a repeated SetUp, close the cursors of the previous DB before it.
+  worker_cursors_.clear();
+  cursor_.reset();
+  db_.reset(db::GetDB(data_param.backend()));
+  db_->Open(data_param.source(), db::READ);
+  const int decode_threads = data_param.decode_threads();
+  CHECK_GT(decode_threads, 0);
+  const int num_shards = data_param.num_shards();
+  const int shard_id = data_param.shard_id();
+  CHECK_GT(num_shards, 0);
+  CHECK_LT(shard_id, num_shards);
+  if (num_shards > 1) {
+    LOG(INFO) << "Reading shard " << shard_id << " of " << num_shards;
+  }
   // Check if we should randomly skip a few data points
-  if (this->layer_param_.data_param().rand_skip()) {
-    unsigned int skip = caffe_rng_rand() %
-                        this->layer_param_.data_param().rand_skip();
+  unsigned int skip = 0;
+  if (data_param.rand_skip()) {
+    skip = caffe_rng_rand() % data_param.rand_skip();
     LOG(INFO) << "Skipping first " << skip << " data points.";
-    while (skip-- > 0) {
-      cursor_->Next();
+  }
+  // Each shard is a contiguous run of the key index, and with parallel
+  // reads it is split further into one run per decode worker, so that every
+  // reader streams through its own part of the database.
+  const int num_cursors = data_param.parallel_read() ? decode_threads : 1;
+  const int num_readers = num_shards * num_cursors;
+  vector<string> keys;
+  if (data_param.shuffle() || num_readers > 1) {
+    LoadKeyIndex(&keys);
+  }
+  if (data_param.shuffle()) {
+    LOG(INFO) << "Shuffling " << keys.size() << " records";
+  }
+  for (int i = 0; i < num_cursors; ++i) {
+    const int reader_id = shard_id * num_cursors + i;
+    const size_t begin = keys.size() * reader_id / num_readers;
+    const size_t end = keys.size() * (reader_id + 1) / num_readers;
+    const vector<string> reader_keys(keys.begin() + begin,
+        keys.begin() + end);
+    db::Cursor* cursor = db_->NewCursor();
+    if (data_param.shuffle()) {
+      // Shuffle each run separately.
+      cursor = new db::ShuffleCursor(cursor, reader_keys,
+          data_param.shuffle_block(), caffe_rng_rand());
+    } else if (num_readers > 1) {
+      cursor = new db::ShardCursor(cursor, reader_keys);
+    }
+    worker_cursors_.push_back(shared_ptr<db::Cursor>(cursor));
+    for (unsigned int j = 0; j < skip && cursor->valid(); ++j) {
+      cursor->Next();
     }
+    if (!cursor->valid()) {
+      cursor->SeekToFirst();
+    }
+    CHECK(cursor->valid()) << "No records to read in "
+        << data_param.source() << " for reader " << i;
+  }
+  cursor_ = worker_cursors_[0];
+  if (num_cursors == 1) {
+    worker_cursors_.clear();
   }
+  next_record_ = 0;
   // Read a data point, and use it to initialize the top blob.
   Datum datum;
-  datum.ParseFromString(cursor_->value());
+  datum.ParseFromArray(cursor_->value_data(), cursor_->value_size());
 
   bool force_color = this->layer_param_.data_param().force_encoded_color();
   if ((force_color && DecodeDatum(&datum, true)) ||
@@ -48,19 +105,22 @@ void DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
     LOG(INFO) << "Decoding Datum";
   }
   // image
+  const int batch_size = this->layer_param_.data_param().batch_size();
   int crop_size = this->layer_param_.transform_param().crop_size();
   if (crop_size > 0) {
-    top[0]->Reshape(this->layer_param_.data_param().batch_size(),
-        datum.channels(), crop_size, crop_size);
-    this->prefetch_data_.Reshape(this->layer_param_.data_param().batch_size(),
-        datum.channels(), crop_size, crop_size);
+    top[0]->Reshape(batch_size, datum.channels(), crop_size, crop_size);
+    for (int i = 0; i < this->prefetch_.size(); ++i) {
+      this->prefetch_[i]->data_.Reshape(batch_size, datum.channels(),
+          crop_size, crop_size);
+    }
     this->transformed_data_.Reshape(1, datum.channels(), crop_size, crop_size);
   } else {
-    top[0]->Reshape(
-        this->layer_param_.data_param().batch_size(), datum.channels(),
+    top[0]->Reshape(batch_size, datum.channels(),
         datum.height(), datum.width());
-    this->prefetch_data_.Reshape(this->layer_param_.data_param().batch_size(),
-        datum.channels(), datum.height(), datum.width());
+    for (int i = 0; i < this->prefetch_.size(); ++i) {
+      this->prefetch_[i]->data_.Reshape(batch_size, datum.channels(),
+          datum.height(), datum.width());
+    }
     this->transformed_data_.Reshape(1, datum.channels(),
       datum.height(), datum.width());
   }
@@ -69,21 +129,58 @@ void DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       << top[0]->width();
   // label
   if (this->output_labels_) {
-    vector<int> label_shape(1, this->layer_param_.data_param().batch_size());
+    vector<int> label_shape(1, batch_size);
     top[1]->Reshape(label_shape);
-    this->prefetch_label_.Reshape(label_shape);
+    for (int i = 0; i < this->prefetch_.size(); ++i) {
+      this->prefetch_[i]->label_.Reshape(label_shape);
+    }
+  }
+  if (data_param.reduced_decode()) {
+    CHECK_GT(crop_size, 0) << "reduced_decode needs a crop_size to cover";
+    LOG(INFO) << "Decoding JPEGs at reduced scales covering " << crop_size;
+  }
+  // batches kept as bytes
+  if (data_param.compact_batches()) {
+    CHECK(!this->transform_param_.has_mean_file())
+        << "compact_batches cannot defer a mean_file; use mean_value";
+    const int mean_values = this->transform_param_.mean_value_size();
+    CHECK(mean_values <= 1 || mean_values == datum.channels())
+        << "Specify either 1 mean_value or as many as channels: "
+        << datum.channels();
+    this->bytes_mean_.Reshape(1, datum.channels(), 1, 1);
+    Dtype* mean = this->bytes_mean_.mutable_cpu_data();
+    for (int c = 0; c < datum.channels(); ++c) {
+      mean[c] = mean_values == 0 ? Dtype(0) :
+          this->transform_param_.mean_value(mean_values == 1 ? 0 : c);
+    }
+    this->bytes_scale_ = this->transform_param_.scale();
+    for (int i = 0; i < this->prefetch_.size(); ++i) {
+      this->prefetch_[i]->bytes_.reset(
+          new SyncedMemory(this->prefetch_[i]->data_.count()));
+    }
+    LOG(INFO) << "Keeping prefetched batches as bytes";
+  }
+  // decode workers
+  if (decode_threads > 1) {
+    LOG(INFO) << "Decoding with " << decode_threads << " threads";
   }
+  batch_datums_.resize(batch_size);
+  decode_transformers_.clear();
+  for (int i = 0; i < decode_threads; ++i) {
+    decode_transformers_.push_back(shared_ptr<DataTransformer<Dtype> >(
+        new DataTransformer<Dtype>(this->transform_param_, this->phase_)));
+    decode_transformers_[i]->InitRand();
+  }
+  decode_pool_.reset(new ThreadPool(decode_threads));
 }
 
-// This function is used to create a thread that prefetches the data.
+// This function is called on the prefetch thread to load a batch.
 template <typename Dtype>
-void DataLayer<Dtype>::InternalThreadEntry() {
-  CPUTimer batch_timer;
-  batch_timer.Start();
+void DataLayer<Dtype>::LoadBatch(Batch<Dtype>* batch) {
   double read_time = 0;
   double trans_time = 0;
   CPUTimer timer;
-  CHECK(this->prefetch_data_.count());
+  CHECK(batch->data_.count());
   CHECK(this->transformed_data_.count());
 
   // Reshape on single input batches for inputs of varying dimension.
@@ -92,7 +189,7 @@ void DataLayer<Dtype>::InternalThreadEntry() {
   bool force_color = this->layer_param_.data_param().force_encoded_color();
   if (batch_size == 1 && crop_size == 0) {
     Datum datum;
-    datum.ParseFromString(cursor_->value());
+    datum.ParseFromArray(cursor_->value_data(), cursor_->value_size());
     if (datum.encoded()) {
       if (force_color) {
         DecodeDatum(&datum, true);
@@ -100,64 +197,199 @@ void DataLayer<Dtype>::InternalThreadEntry() {
         DecodeDatumNative(&datum);
       }
     }
-    this->prefetch_data_.Reshape(1, datum.channels(),
+    batch->data_.Reshape(1, datum.channels(),
         datum.height(), datum.width());
     this->transformed_data_.Reshape(1, datum.channels(),
         datum.height(), datum.width());
+    if (batch->bytes_ && batch->bytes_->size() != batch->data_.count()) {
+      batch->bytes_.reset(new SyncedMemory(batch->data_.count()));
+    }
+  }
+  // Bring the batch to the host once, before the workers fill it. They
+  // overwrite all of it, so neither zero it nor copy it back from the GPU.
+  if (batch->bytes_) {
+    batch->bytes_->write_only_cpu_data();
+  } else {
+    batch->data_.write_only_cpu_data();
+  }
+  if (this->output_labels_) {
+    batch->label_.write_only_cpu_data();
+  }
+
+  // Read the records of the batch in cursor order, unless the decode workers
+  // read their own.
+  timer.Start();
+  if (worker_cursors_.empty()) {
+    for (int item_id = 0; item_id < batch_size; ++item_id) {
+      ReadItem(cursor_.get(), item_id);
+    }
+  }
+  read_time += timer.MicroSeconds();
+  timer.Start();
+  // Decode and transform them on the decode workers.
+  decode_pool_->Run(
+      boost::bind(&DataLayer<Dtype>::DecodeItems, this, _1, batch));
+  next_record_ += batch_size;
+  trans_time += timer.MicroSeconds();
+  batch->stats_.read_time = read_time;
+  batch->stats_.transform_time = trans_time;
+}
+
+// Whether keys look like the index of db: the first key is the DB's first
+// record and the last one its last record.
+static bool KeyIndexMatches(db::DB* db, const vector<string>& keys) {
+  if (keys.empty()) {
+    return false;
+  }
+  shared_ptr<db::Cursor> cursor(db->NewCursor());
+  if (!cursor->valid() || cursor->key() != keys.front() ||
+      !cursor->Seek(keys.back())) {
+    return false;
   }
+  cursor->Next();
+  return !cursor->valid();
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::LoadKeyIndex(vector<string>* keys) {
+  const string& index = this->layer_param_.data_param().key_index();
+  keys->clear();
+  if (!index.empty()) {
+    std::ifstream infile(index.c_str());
+    if (infile.good()) {
+      string key;
+      while (std::getline(infile, key)) {
+        keys->push_back(key);
+      }
+      if (KeyIndexMatches(db_.get(), *keys)) {
+        LOG(INFO) << "Read " << keys->size() << " keys from " << index;
+        return;
+      }
+      LOG(WARNING) << "Key index " << index << " does not match "
+          << this->layer_param_.data_param().source() << "; rebuilding it";
+      keys->clear();
+    }
+  }
+  if (index.empty()) {
+    LOG(WARNING) << "Scanning every key of "
+        << this->layer_param_.data_param().source() << " to split or shuffle"
+        << " it; set key_index to scan it once for all runs and processes";
+  }
+  shared_ptr<db::Cursor> cursor(db_->NewCursor());
+  for (; cursor->valid(); cursor->Next()) {
+    keys->push_back(cursor->key());
+  }
+  if (!index.empty()) {
+    // Write a file of our own and rename it over the index, so that other
+    // processes building the same index never see a partial one.
+    std::ostringstream temp;
+    temp << index << ".tmp." << getpid();
+    std::ofstream outfile(temp.str().c_str());
+    CHECK(outfile.good()) << "Failed to open key index " << temp.str();
+    for (int i = 0; i < keys->size(); ++i) {
+      CHECK_EQ((*keys)[i].find('\n'), string::npos)
+          << "Keys with newlines cannot be cached in a key index";
+      outfile << (*keys)[i] << '\n';
+    }
+    outfile.close();
+    CHECK(outfile.good()) << "Failed to write key index " << temp.str();
+    CHECK_EQ(rename(temp.str().c_str(), index.c_str()), 0)
+        << "Failed to rename " << temp.str() << " to " << index;
+    LOG(INFO) << "Wrote " << keys->size() << " keys to " << index;
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::ReadItem(db::Cursor* cursor, int item_id) {
+  // Parse straight from the database's memory.
+  batch_datums_[item_id].ParseFromArray(cursor->value_data(),
+      cursor->value_size());
+  // go to the next iter
+  cursor->Next();
+  if (!cursor->valid()) {
+    DLOG(INFO) << "Restarting data prefetching from start.";
+    cursor->SeekToFirst();
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::DecodeItems(int worker_id, Batch<Dtype>* batch) {
+  const int batch_size = this->layer_param_.data_param().batch_size();
+  const bool force_color =
+      this->layer_param_.data_param().force_encoded_color();
+  const int num_workers = decode_pool_->size();
+  // Smallest size the decoded images must cover, if they may be reduced.
+  const int min_size = this->layer_param_.data_param().reduced_decode() ?
+      this->layer_param_.transform_param().crop_size() : 0;
+  DataTransformer<Dtype>* transformer = decode_transformers_[worker_id].get();
+  Blob<Dtype> transformed_data;
+  transformed_data.ReshapeLike(this->transformed_data_);
 
-  Dtype* top_data = this->prefetch_data_.mutable_cpu_data();
+  Dtype* top_data = NULL;
+  uint8_t* top_bytes = NULL;
   Dtype* top_label = NULL;  // suppress warnings about uninitialized variables
 
+  if (batch->bytes_) {
+    top_bytes = static_cast<uint8_t*>(batch->bytes_->mutable_cpu_data());
+  } else {
+    top_data = batch->data_.mutable_cpu_data();
+  }
+
   if (this->output_labels_) {
-    top_label = this->prefetch_label_.mutable_cpu_data();
+    top_label = batch->label_.mutable_cpu_data();
   }
-  for (int item_id = 0; item_id < batch_size; ++item_id) {
-    timer.Start();
-    // get a blob
-    Datum datum;
-    datum.ParseFromString(cursor_->value());
+  // The readers take turns across batches, record next_record_ + item_id
+  // coming from reader (next_record_ + item_id) % num_workers. All the slots
+  // of this worker thus come from one reader, and every reader advances at
+  // the same rate even when num_workers does not divide the batch size.
+  db::Cursor* cursor = worker_cursors_.empty() ? NULL :
+      worker_cursors_[(next_record_ + worker_id) % num_workers].get();
+  for (int item_id = worker_id; item_id < batch_size;
+       item_id += num_workers) {
+    if (cursor) {
+      ReadItem(cursor, item_id);
+    }
+    const Datum& datum = batch_datums_[item_id];
 
     cv::Mat cv_img;
     if (datum.encoded()) {
       if (force_color) {
-        cv_img = DecodeDatumToCVMat(datum, true);
+        cv_img = DecodeDatumToCVMat(datum, true, min_size, min_size);
+      } else if (min_size > 0) {
+        // Reduced decoding needs a fixed color mode; use the layer's.
+        cv_img = DecodeDatumToCVMat(datum, transformed_data.channels() == 3,
+            min_size, min_size);
       } else {
         cv_img = DecodeDatumToCVMatNative(datum);
       }
-      if (cv_img.channels() != this->transformed_data_.channels()) {
+      if (cv_img.channels() != transformed_data.channels()) {
         LOG(WARNING) << "Your dataset contains encoded images with mixed "
         << "channel sizes. Consider adding a 'force_color' flag to the "
         << "model definition, or rebuild your dataset using "
         << "convert_imageset.";
       }
     }
-    read_time += timer.MicroSeconds();
-    timer.Start();
 
     // Apply data transformations (mirror, scale, crop...)
-    int offset = this->prefetch_data_.offset(item_id);
-    this->transformed_data_.set_cpu_data(top_data + offset);
-    if (datum.encoded()) {
-      this->data_transformer_->Transform(cv_img, &(this->transformed_data_));
+    int offset = batch->data_.offset(item_id);
+    if (top_bytes) {
+      if (datum.encoded()) {
+        transformer->TransformBytes(cv_img, top_bytes + offset);
+      } else {
+        transformer->TransformBytes(datum, top_bytes + offset);
+      }
     } else {
-      this->data_transformer_->Transform(datum, &(this->transformed_data_));
+      transformed_data.set_cpu_data(top_data + offset);
+      if (datum.encoded()) {
+        transformer->Transform(cv_img, &transformed_data);
+      } else {
+        transformer->Transform(datum, &transformed_data);
+      }
     }
     if (this->output_labels_) {
       top_label[item_id] = datum.label();
     }
-    trans_time += timer.MicroSeconds();
-    // go to the next iter
-    cursor_->Next();
-    if (!cursor_->valid()) {
-      DLOG(INFO) << "Restarting data prefetching from start.";
-      cursor_->SeekToFirst();
-    }
   }
-  batch_timer.Stop();
-  DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
-  DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
-  DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
 }
 
 INSTANTIATE_CLASS(DataLayer);
@@ -1,11 +1,4 @@
-/*
-TODO:
-- load file in a separate thread ("prefetch")
-- can be smarter about the memcpy call instead of doing it row-by-row
-  :: use util functions caffe_copy, and Blob->offset()
-  :: don't forget to update hdf5_daa_layer.cu accordingly
-- add ability to shuffle filenames if flag is set
-*/
+#include <algorithm>
 #include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
@@ -16,61 +9,107 @@ TODO:
 
 #include "caffe/data_layers.hpp"
 #include "caffe/layer.hpp"
+#include "caffe/util/benchmark.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/rng.hpp"
 
 namespace caffe {
 
+// The blob of the batch that holds the rows of top i.
 template <typename Dtype>
-HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() { }
+static Blob<Dtype>* BatchBlob(Batch<Dtype>* batch, int i) {
+  return (i == 0) ? &batch->data_ :
+      (i == 1) ? &batch->label_ : batch->extra_[i - 2].get();
+}
+
+template <typename Dtype>
+HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() {
+  this->StopInternalThread();
+  if (file_id_ >= 0) {
+    HDF5Lock lock;
+    H5Fclose(file_id_);
+  }
+}
 
-// Load data and label from HDF5 filename into the class property blobs.
+// Open the HDF5 file and load its first window of rows into the class
+// property blobs.
 template <typename Dtype>
 void HDF5DataLayer<Dtype>::LoadHDF5FileData(const char* filename) {
   DLOG(INFO) << "Loading HDF5 file: " << filename;
-  hid_t file_id = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
-  if (file_id < 0) {
+  HDF5Lock lock;
+  if (file_id_ >= 0) {
+    herr_t status = H5Fclose(file_id_);
+    CHECK_GE(status, 0) << "Failed to close HDF5 file";
+  }
+  file_id_ = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (file_id_ < 0) {
     LOG(FATAL) << "Failed opening HDF5 file: " << filename;
   }
 
-  int top_size = this->layer_param_.top_size();
-  hdf_blobs_.resize(top_size);
-
   const int MIN_DATA_DIM = 1;
   const int MAX_DATA_DIM = INT_MAX;
 
-  for (int i = 0; i < top_size; ++i) {
-    hdf_blobs_[i] = shared_ptr<Blob<Dtype> >(new Blob<Dtype>());
-    hdf5_load_nd_dataset(file_id, this->layer_param_.top(i).c_str(),
-        MIN_DATA_DIM, MAX_DATA_DIM, hdf_blobs_[i].get());
+  // MinTopBlobs==1 guarantees at least one top blob
+  vector<int> shape;
+  for (int i = 0; i < this->layer_param_.top_size(); ++i) {
+    hdf5_get_nd_dataset_shape(file_id_, this->layer_param_.top(i).c_str(),
+        MIN_DATA_DIM, MAX_DATA_DIM, &shape);
+    if (i == 0) {
+      file_rows_ = shape[0];
+    }
+    CHECK_EQ(shape[0], file_rows_);
   }
+  CHECK_GT(file_rows_, 0) << "No rows in HDF5 file: " << filename;
+  file_row_ = 0;
+  LoadHDF5Window();
+}
 
-  herr_t status = H5Fclose(file_id);
-  CHECK_GE(status, 0) << "Failed to close HDF5 file: " << filename;
-
-  // MinTopBlobs==1 guarantees at least one top blob
-  CHECK_GE(hdf_blobs_[0]->num_axes(), 1) << "Input must have at least 1 axis.";
-  const int num = hdf_blobs_[0]->shape(0);
-  for (int i = 1; i < top_size; ++i) {
-    CHECK_EQ(hdf_blobs_[i]->shape(0), num);
+// Load the next window_size rows of the open file, or the rest of them.
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::LoadHDF5Window() {
+  const int window_size = this->layer_param_.hdf5_data_param().window_size();
+  int num_rows = file_rows_ - file_row_;
+  if (window_size > 0) {
+    num_rows = std::min(num_rows, window_size);
+  }
+  const int top_size = this->layer_param_.top_size();
+  HDF5Lock lock;
+  hdf_blobs_.resize(top_size);
+  for (int i = 0; i < top_size; ++i) {
+    if (!hdf_blobs_[i]) {
+      hdf_blobs_[i].reset(new Blob<Dtype>());
+    }
+    hdf5_load_nd_dataset_rows(file_id_, this->layer_param_.top(i).c_str(),
+        1, INT_MAX, file_row_, num_rows, hdf_blobs_[i].get());
   }
+  file_row_ += num_rows;
+  current_row_ = 0;
+
   // Default to identity permutation.
   data_permutation_.clear();
-  data_permutation_.resize(hdf_blobs_[0]->shape(0));
-  for (int i = 0; i < hdf_blobs_[0]->shape(0); i++)
+  data_permutation_.resize(num_rows);
+  for (int i = 0; i < num_rows; i++)
     data_permutation_[i] = i;
 
   // Shuffle if needed.
   if (this->layer_param_.hdf5_data_param().shuffle()) {
-    std::random_shuffle(data_permutation_.begin(), data_permutation_.end());
-    DLOG(INFO) << "Successully loaded " << hdf_blobs_[0]->shape(0)
-               << " rows (shuffled)";
+    ShuffleRows();
+    DLOG(INFO) << "Successully loaded " << num_rows << " rows (shuffled)";
   } else {
-    DLOG(INFO) << "Successully loaded " << hdf_blobs_[0]->shape(0) << " rows";
+    DLOG(INFO) << "Successully loaded " << num_rows << " rows";
   }
 }
 
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+void HDF5DataLayer<Dtype>::ShuffleRows() {
+  caffe::rng_t* prefetch_rng =
+      static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+  shuffle(data_permutation_.begin(), data_permutation_.end(), prefetch_rng);
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   // Refuse transformation parameters since HDF5 is totally generic.
   CHECK(!this->layer_param_.has_transform_param()) <<
@@ -104,17 +143,26 @@ void HDF5DataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
 
   // Shuffle if needed.
   if (this->layer_param_.hdf5_data_param().shuffle()) {
-    std::random_shuffle(file_permutation_.begin(), file_permutation_.end());
+    const unsigned int prefetch_rng_seed = caffe_rng_rand();
+    prefetch_rng_.reset(new Caffe::RNG(prefetch_rng_seed));
+    caffe::rng_t* prefetch_rng =
+        static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+    shuffle(file_permutation_.begin(), file_permutation_.end(), prefetch_rng);
   }
 
   // Load the first HDF5 file and initialize the line counter.
   LoadHDF5FileData(hdf_filenames_[file_permutation_[current_file_]].c_str());
-  current_row_ = 0;
 
   // Reshape blobs.
   const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
   const int top_size = this->layer_param_.top_size();
   vector<int> top_shape;
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->extra_.resize(std::max(top_size - 2, 0));
+    for (int j = 0; j < this->prefetch_[i]->extra_.size(); ++j) {
+      this->prefetch_[i]->extra_[j].reset(new Blob<Dtype>());
+    }
+  }
   for (int i = 0; i < top_size; ++i) {
     top_shape.resize(hdf_blobs_[i]->num_axes());
     top_shape[0] = batch_size;
@@ -122,45 +170,65 @@ void HDF5DataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       top_shape[j] = hdf_blobs_[i]->shape(j);
     }
     top[i]->Reshape(top_shape);
+    for (int j = 0; j < this->prefetch_.size(); ++j) {
+      BatchBlob(this->prefetch_[j].get(), i)->Reshape(top_shape);
+    }
   }
 }
 
+// This function is called on the prefetch thread to load a batch.
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top) {
+void HDF5DataLayer<Dtype>::LoadBatch(Batch<Dtype>* batch) {
+  CPUTimer timer;
+  double read_time = 0;
   const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
+  const int top_size = this->layer_param_.top_size();
+  vector<Dtype*> batch_data(top_size);
+  for (int j = 0; j < top_size; ++j) {
+    batch_data[j] = BatchBlob(batch, j)->write_only_cpu_data();
+  }
   for (int i = 0; i < batch_size; ++i, ++current_row_) {
     if (current_row_ == hdf_blobs_[0]->shape(0)) {
-      if (num_files_ > 1) {
+      timer.Start();
+      if (file_row_ < file_rows_) {
+        LoadHDF5Window();
+      } else if (num_files_ > 1) {
         ++current_file_;
         if (current_file_ == num_files_) {
           current_file_ = 0;
           if (this->layer_param_.hdf5_data_param().shuffle()) {
-            std::random_shuffle(file_permutation_.begin(),
-                                file_permutation_.end());
+            caffe::rng_t* prefetch_rng =
+                static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+            shuffle(file_permutation_.begin(), file_permutation_.end(),
+                prefetch_rng);
           }
           DLOG(INFO) << "Looping around to first file.";
         }
         LoadHDF5FileData(
             hdf_filenames_[file_permutation_[current_file_]].c_str());
+      } else if (hdf_blobs_[0]->shape(0) < file_rows_) {
+        // Go back to the first window of the only file.
+        file_row_ = 0;
+        LoadHDF5Window();
+      } else {
+        // The only file fits in one window, which is kept.
+        current_row_ = 0;
+        if (this->layer_param_.hdf5_data_param().shuffle()) {
+          ShuffleRows();
+        }
       }
-      current_row_ = 0;
-      if (this->layer_param_.hdf5_data_param().shuffle())
-        std::random_shuffle(data_permutation_.begin(), data_permutation_.end());
+      read_time += timer.MicroSeconds();
     }
-    for (int j = 0; j < this->layer_param_.top_size(); ++j) {
-      int data_dim = top[j]->count() / top[j]->shape(0);
+    for (int j = 0; j < top_size; ++j) {
+      int data_dim = hdf_blobs_[j]->count() / hdf_blobs_[j]->shape(0);
       caffe_copy(data_dim,
           &hdf_blobs_[j]->cpu_data()[data_permutation_[current_row_]
-            * data_dim], &top[j]->mutable_cpu_data()[i * data_dim]);
+            * data_dim], &batch_data[j][i * data_dim]);
     }
   }
+  batch->stats_.read_time = read_time;
 }
 
-#ifdef CPU_ONLY
-STUB_GPU_FORWARD(HDF5DataLayer, Forward);
-#endif
-
 INSTANTIATE_CLASS(HDF5DataLayer);
 REGISTER_LAYER_CLASS(HDF5Data);
 
@@ -14,51 +14,93 @@ namespace caffe {
 template <typename Dtype>
 void HDF5OutputLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
+  // Finish the previous file, if any, before reusing the batches.
+  CloseFile();
+  Batch<Dtype>* batch;
+  while (batch_full_.try_pop(&batch)) {}
+  while (batch_free_.try_pop(&batch)) {}
   file_name_ = this->layer_param_.hdf5_output_param().file_name();
-  file_id_ = H5Fcreate(file_name_.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
-                       H5P_DEFAULT);
+  {
+    HDF5Lock lock;
+    file_id_ = H5Fcreate(file_name_.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
+                         H5P_DEFAULT);
+  }
   CHECK_GE(file_id_, 0) << "Failed to open HDF5 file" << file_name_;
   file_opened_ = true;
+  const int queue_size = this->layer_param_.hdf5_output_param().queue_size();
+  CHECK_GT(queue_size, 0) << "At least one batch must be buffered.";
+  batches_.resize(queue_size);
+  for (int i = 0; i < batches_.size(); ++i) {
+    batches_[i].reset(new Batch<Dtype>());
+    batch_free_.push(batches_[i].get());
+  }
+  CHECK(!is_started()) << "Writer thread is still running";
+  CHECK(StartInternalThread()) << "Thread execution failed";
 }
 
 template <typename Dtype>
 HDF5OutputLayer<Dtype>::~HDF5OutputLayer<Dtype>() {
+  CloseFile();
+}
+
+template <typename Dtype>
+void HDF5OutputLayer<Dtype>::CloseFile() {
+  if (is_started()) {
+    // Let the thread write out the queued batches, then stop.
+    batch_full_.push(NULL);
+    WaitForInternalThreadToExit();
+  }
   if (file_opened_) {
+    HDF5Lock lock;
     herr_t status = H5Fclose(file_id_);
     CHECK_GE(status, 0) << "Failed to close HDF5 file " << file_name_;
+    file_opened_ = false;
+  }
+}
+
+template <typename Dtype>
+void HDF5OutputLayer<Dtype>::InternalThreadEntry() {
+  for (Batch<Dtype>* batch = batch_full_.pop(); batch != NULL;
+       batch = batch_full_.pop()) {
+    SaveBlobs(*batch);
+    batch_free_.push(batch);
   }
 }
 
 template <typename Dtype>
-void HDF5OutputLayer<Dtype>::SaveBlobs() {
+Batch<Dtype>* HDF5OutputLayer<Dtype>::NextBatch(
+    const vector<Blob<Dtype>*>& bottom) {
+  CHECK_GE(bottom.size(), 2);
+  CHECK_EQ(bottom[0]->num(), bottom[1]->num());
+  Batch<Dtype>* batch = batch_free_.pop("HDF5 output queue full");
+  batch->data_.Reshape(bottom[0]->num(), bottom[0]->channels(),
+                       bottom[0]->height(), bottom[0]->width());
+  batch->label_.Reshape(bottom[1]->num(), bottom[1]->channels(),
+                        bottom[1]->height(), bottom[1]->width());
+  return batch;
+}
+
+template <typename Dtype>
+void HDF5OutputLayer<Dtype>::SaveBlobs(const Batch<Dtype>& batch) {
   // TODO: no limit on the number of blobs
-  LOG(INFO) << "Saving HDF5 file " << file_name_;
-  CHECK_EQ(data_blob_.num(), label_blob_.num()) <<
+  DLOG(INFO) << "Saving to HDF5 file " << file_name_;
+  CHECK_EQ(batch.data_.num(), batch.label_.num()) <<
       "data blob and label blob must have the same batch size";
-  hdf5_save_nd_dataset(file_id_, HDF5_DATA_DATASET_NAME, data_blob_);
-  hdf5_save_nd_dataset(file_id_, HDF5_DATA_LABEL_NAME, label_blob_);
-  LOG(INFO) << "Successfully saved " << data_blob_.num() << " rows";
+  HDF5Lock lock;
+  hdf5_append_nd_dataset(file_id_, HDF5_DATA_DATASET_NAME, batch.data_);
+  hdf5_append_nd_dataset(file_id_, HDF5_DATA_LABEL_NAME, batch.label_);
+  DLOG(INFO) << "Successfully saved " << batch.data_.num() << " rows";
 }
 
 template <typename Dtype>
 void HDF5OutputLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
-  CHECK_GE(bottom.size(), 2);
-  CHECK_EQ(bottom[0]->num(), bottom[1]->num());
-  data_blob_.Reshape(bottom[0]->num(), bottom[0]->channels(),
-                     bottom[0]->height(), bottom[0]->width());
-  label_blob_.Reshape(bottom[1]->num(), bottom[1]->channels(),
-                     bottom[1]->height(), bottom[1]->width());
-  const int data_datum_dim = bottom[0]->count() / bottom[0]->num();
-  const int label_datum_dim = bottom[1]->count() / bottom[1]->num();
-
-  for (int i = 0; i < bottom[0]->num(); ++i) {
-    caffe_copy(data_datum_dim, &bottom[0]->cpu_data()[i * data_datum_dim],
-        &data_blob_.mutable_cpu_data()[i * data_datum_dim]);
-    caffe_copy(label_datum_dim, &bottom[1]->cpu_data()[i * label_datum_dim],
-        &label_blob_.mutable_cpu_data()[i * label_datum_dim]);
-  }
-  SaveBlobs();
+  Batch<Dtype>* batch = NextBatch(bottom);
+  caffe_copy(bottom[0]->count(), bottom[0]->cpu_data(),
+      batch->data_.mutable_cpu_data());
+  caffe_copy(bottom[1]->count(), bottom[1]->cpu_data(),
+      batch->label_.mutable_cpu_data());
+  batch_full_.push(batch);
 }
 
 template <typename Dtype>
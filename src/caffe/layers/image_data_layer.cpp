@@ -1,5 +1,6 @@
 #include <opencv2/core/core.hpp>
 
+#include <algorithm>
 #include <fstream>  // NOLINT(readability/streams)
 #include <iostream>  // NOLINT(readability/streams)
 #include <string>
@@ -17,7 +18,7 @@ namespace caffe {
 
 template <typename Dtype>
 ImageDataLayer<Dtype>::~ImageDataLayer<Dtype>() {
-  this->JoinPrefetchThread();
+  this->StopInternalThread();
 }
 
 template <typename Dtype>
@@ -59,6 +60,12 @@ void ImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
     CHECK_GT(lines_.size(), skip) << "Not enough points to skip";
     lines_id_ = skip;
   }
+  readahead_id_ = lines_id_;
+  next_order_.clear();
+  if (this->layer_param_.image_data_param().cache_bytes() > 0) {
+    image_cache_.reset(
+        new ImageCache(this->layer_param_.image_data_param().cache_bytes()));
+  }
   // Read an image, and use it to initialize the top blob.
   cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_].first,
                                     new_height, new_width, is_color);
@@ -70,11 +77,16 @@ void ImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   const int batch_size = this->layer_param_.image_data_param().batch_size();
   if (crop_size > 0) {
     top[0]->Reshape(batch_size, channels, crop_size, crop_size);
-    this->prefetch_data_.Reshape(batch_size, channels, crop_size, crop_size);
+    for (int i = 0; i < this->prefetch_.size(); ++i) {
+      this->prefetch_[i]->data_.Reshape(batch_size, channels,
+          crop_size, crop_size);
+    }
     this->transformed_data_.Reshape(1, channels, crop_size, crop_size);
   } else {
     top[0]->Reshape(batch_size, channels, height, width);
-    this->prefetch_data_.Reshape(batch_size, channels, height, width);
+    for (int i = 0; i < this->prefetch_.size(); ++i) {
+      this->prefetch_[i]->data_.Reshape(batch_size, channels, height, width);
+    }
     this->transformed_data_.Reshape(1, channels, height, width);
   }
   LOG(INFO) << "output data size: " << top[0]->num() << ","
@@ -83,7 +95,9 @@ void ImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   // label
   vector<int> label_shape(1, batch_size);
   top[1]->Reshape(label_shape);
-  this->prefetch_label_.Reshape(label_shape);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->label_.Reshape(label_shape);
+  }
 }
 
 template <typename Dtype>
@@ -93,15 +107,37 @@ void ImageDataLayer<Dtype>::ShuffleImages() {
   shuffle(lines_.begin(), lines_.end(), prefetch_rng);
 }
 
-// This function is used to create a thread that prefetches the data.
 template <typename Dtype>
-void ImageDataLayer<Dtype>::InternalThreadEntry() {
-  CPUTimer batch_timer;
-  batch_timer.Start();
+const string& ImageDataLayer<Dtype>::UpcomingFile(int id) {
+  const int lines_size = lines_.size();
+  if (id < lines_size) {
+    return lines_[id].first;
+  }
+  id -= lines_size;
+  if (!this->layer_param_.image_data_param().shuffle()) {
+    return lines_[id].first;
+  }
+  if (next_order_.empty()) {
+    // Shuffle indices the way ShuffleImages shuffles the lines, so that the
+    // order is the same as if it were drawn at the start of the epoch.
+    next_order_.resize(lines_size);
+    for (int i = 0; i < lines_size; ++i) {
+      next_order_[i] = i;
+    }
+    caffe::rng_t* prefetch_rng =
+        static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+    shuffle(next_order_.begin(), next_order_.end(), prefetch_rng);
+  }
+  return lines_[next_order_[id]].first;
+}
+
+// This function is called on the prefetch thread to load a batch.
+template <typename Dtype>
+void ImageDataLayer<Dtype>::LoadBatch(Batch<Dtype>* batch) {
   double read_time = 0;
   double trans_time = 0;
   CPUTimer timer;
-  CHECK(this->prefetch_data_.count());
+  CHECK(batch->data_.count());
   CHECK(this->transformed_data_.count());
   ImageDataParameter image_data_param = this->layer_param_.image_data_param();
   const int batch_size = image_data_param.batch_size();
@@ -110,19 +146,20 @@ void ImageDataLayer<Dtype>::InternalThreadEntry() {
   const int crop_size = this->layer_param_.transform_param().crop_size();
   const bool is_color = image_data_param.is_color();
   string root_folder = image_data_param.root_folder();
+  const int readahead = image_data_param.readahead();
 
   // Reshape on single input batches for inputs of varying dimension.
   if (batch_size == 1 && crop_size == 0 && new_height == 0 && new_width == 0) {
     cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_].first,
         0, 0, is_color);
-    this->prefetch_data_.Reshape(1, cv_img.channels(),
+    batch->data_.Reshape(1, cv_img.channels(),
         cv_img.rows, cv_img.cols);
     this->transformed_data_.Reshape(1, cv_img.channels(),
         cv_img.rows, cv_img.cols);
   }
 
-  Dtype* prefetch_data = this->prefetch_data_.mutable_cpu_data();
-  Dtype* prefetch_label = this->prefetch_label_.mutable_cpu_data();
+  Dtype* prefetch_data = batch->data_.write_only_cpu_data();
+  Dtype* prefetch_label = batch->label_.write_only_cpu_data();
 
   // datum scales
   const int lines_size = lines_.size();
@@ -130,13 +167,29 @@ void ImageDataLayer<Dtype>::InternalThreadEntry() {
     // get a blob
     timer.Start();
     CHECK_GT(lines_size, lines_id_);
-    cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_].first,
-        new_height, new_width, is_color);
-    CHECK(cv_img.data) << "Could not load " << lines_[lines_id_].first;
+    // Keep the next files being read while this one is decoded, into the
+    // next epoch if need be, unless their images are already cached.
+    const int readahead_end = lines_id_ + std::min(readahead, lines_size);
+    for (; readahead_id_ < readahead_end; ++readahead_id_) {
+      const string upcoming = root_folder + UpcomingFile(readahead_id_);
+      if (!image_cache_ || !image_cache_->Contains(upcoming)) {
+        ReadAheadFile(upcoming);
+      }
+    }
+    const string filename = root_folder + lines_[lines_id_].first;
+    cv::Mat cv_img;
+    if (!image_cache_ || !image_cache_->Get(filename, &cv_img)) {
+      cv_img = ReadImageToCVMat(filename, new_height, new_width, is_color,
+          image_data_param.reduced_decode());
+      CHECK(cv_img.data) << "Could not load " << lines_[lines_id_].first;
+      if (image_cache_) {
+        image_cache_->Put(filename, cv_img);
+      }
+    }
     read_time += timer.MicroSeconds();
     timer.Start();
     // Apply transformations (mirror, crop...) to the image
-    int offset = this->prefetch_data_.offset(item_id);
+    int offset = batch->data_.offset(item_id);
     this->transformed_data_.set_cpu_data(prefetch_data + offset);
     this->data_transformer_->Transform(cv_img, &(this->transformed_data_));
     trans_time += timer.MicroSeconds();
@@ -148,15 +201,23 @@ void ImageDataLayer<Dtype>::InternalThreadEntry() {
       // We have reached the end. Restart from the first.
       DLOG(INFO) << "Restarting data prefetching from start.";
       lines_id_ = 0;
+      readahead_id_ = std::max(readahead_id_ - lines_size, 0);
       if (this->layer_param_.image_data_param().shuffle()) {
-        ShuffleImages();
+        if (next_order_.empty()) {
+          ShuffleImages();
+        } else {
+          vector<std::pair<std::string, int> > lines(lines_size);
+          for (int i = 0; i < lines_size; ++i) {
+            std::swap(lines[i], lines_[next_order_[i]]);
+          }
+          lines_.swap(lines);
+          next_order_.clear();
+        }
       }
     }
   }
-  batch_timer.Stop();
-  DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
-  DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
-  DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+  batch->stats_.read_time = read_time;
+  batch->stats_.transform_time = trans_time;
 }
 
 INSTANTIATE_CLASS(ImageDataLayer);
@@ -5,6 +5,7 @@
 #include "caffe/data_layers.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
 
 namespace caffe {
 
@@ -28,6 +29,51 @@ void MemoryDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   labels_ = NULL;
   added_data_.cpu_data();
   added_label_.cpu_data();
+  const int ring_size = this->layer_param_.memory_data_param().ring_size();
+  if (ring_size > 0) {
+    CHECK_GE(ring_size, 2) << "The ring needs a batch for the net to consume"
+        " while producers fill another";
+    for (int i = 0; i < ring_size; ++i) {
+      ring_.push_back(shared_ptr<Batch<Dtype> >(new Batch<Dtype>()));
+      ring_[i]->data_.Reshape(batch_size_, channels_, height_, width_);
+      ring_[i]->label_.Reshape(batch_size_, 1, 1, 1);
+      ring_[i]->data_.mutable_cpu_data();
+      ring_[i]->label_.mutable_cpu_data();
+      ring_free_.push(ring_[i].get());
+    }
+    // Producers transform batches concurrently, so give each its own
+    // transformer rather than sharing the layer's.
+    DataTransformer<Dtype>* transformer;
+    while (ring_transformer_free_.try_pop(&transformer)) {}
+    ring_transformers_.clear();
+    for (int i = 0; i < ring_size; ++i) {
+      ring_transformers_.push_back(shared_ptr<DataTransformer<Dtype> >(
+          new DataTransformer<Dtype>(this->transform_param_, this->phase_)));
+      ring_transformers_[i]->InitRand();
+      ring_transformer_free_.push(ring_transformers_[i].get());
+    }
+  }
+}
+
+template <typename Dtype>
+Batch<Dtype>* MemoryDataLayer<Dtype>::AcquireBatch() {
+  CHECK(!ring_.empty()) << "memory_data_param.ring_size must be set to stream"
+      " batches";
+  return ring_free_.pop();
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::PushBatch(Batch<Dtype>* batch) {
+  ring_full_.push(batch);
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::AddBatch(const Dtype* data,
+    const Dtype* labels) {
+  Batch<Dtype>* batch = AcquireBatch();
+  caffe_copy(batch->data_.count(), data, batch->data_.mutable_cpu_data());
+  caffe_copy(batch->label_.count(), labels, batch->label_.mutable_cpu_data());
+  PushBatch(batch);
 }
 
 template <typename Dtype>
@@ -38,6 +84,23 @@ void MemoryDataLayer<Dtype>::AddDatumVector(const vector<Datum>& datum_vector) {
   CHECK_GT(num, 0) << "There is no datum to add.";
   CHECK_EQ(num % batch_size_, 0) <<
       "The added data must be a multiple of the batch size.";
+  if (!ring_.empty()) {
+    Blob<Dtype> transformed_data(1, channels_, height_, width_);
+    for (int item_id = 0; item_id < num; item_id += batch_size_) {
+      Batch<Dtype>* batch = AcquireBatch();
+      DataTransformer<Dtype>* transformer = ring_transformer_free_.pop();
+      Dtype* batch_data = batch->data_.mutable_cpu_data();
+      Dtype* batch_label = batch->label_.mutable_cpu_data();
+      for (int i = 0; i < batch_size_; ++i) {
+        transformed_data.set_cpu_data(batch_data + batch->data_.offset(i));
+        transformer->Transform(datum_vector[item_id + i], &transformed_data);
+        batch_label[i] = datum_vector[item_id + i].label();
+      }
+      ring_transformer_free_.push(transformer);
+      PushBatch(batch);
+    }
+    return;
+  }
   added_data_.Reshape(num, channels_, height_, width_);
   added_label_.Reshape(num, 1, 1, 1);
   // Apply data transformations (mirror, scale, crop...)
@@ -62,6 +125,23 @@ void MemoryDataLayer<Dtype>::AddMatVector(const vector<cv::Mat>& mat_vector,
   CHECK_GT(num, 0) << "There is no mat to add";
   CHECK_EQ(num % batch_size_, 0) <<
       "The added data must be a multiple of the batch size.";
+  if (!ring_.empty()) {
+    Blob<Dtype> transformed_data(1, channels_, height_, width_);
+    for (int item_id = 0; item_id < num; item_id += batch_size_) {
+      Batch<Dtype>* batch = AcquireBatch();
+      DataTransformer<Dtype>* transformer = ring_transformer_free_.pop();
+      Dtype* batch_data = batch->data_.mutable_cpu_data();
+      Dtype* batch_label = batch->label_.mutable_cpu_data();
+      for (int i = 0; i < batch_size_; ++i) {
+        transformed_data.set_cpu_data(batch_data + batch->data_.offset(i));
+        transformer->Transform(mat_vector[item_id + i], &transformed_data);
+        batch_label[i] = labels[item_id + i];
+      }
+      ring_transformer_free_.push(transformer);
+      PushBatch(batch);
+    }
+    return;
+  }
   added_data_.Reshape(num, channels_, height_, width_);
   added_label_.Reshape(num, 1, 1, 1);
   // Apply data transformations (mirror, scale, crop...)
@@ -81,6 +161,7 @@ template <typename Dtype>
 void MemoryDataLayer<Dtype>::Reset(Dtype* data, Dtype* labels, int n) {
   CHECK(data);
   CHECK(labels);
+  CHECK(ring_.empty()) << "Batches are streamed through the ring, not Reset";
   CHECK_EQ(n % batch_size_, 0) << "n must be a multiple of batch size";
   // Warn with transformation parameters since a memory array is meant to
   // be generic and no transformations are done with Reset().
@@ -100,11 +181,32 @@ void MemoryDataLayer<Dtype>::set_batch_size(int new_size) {
   batch_size_ = new_size;
   added_data_.Reshape(batch_size_, channels_, height_, width_);
   added_label_.Reshape(batch_size_, 1, 1, 1);
+  if (!ring_.empty()) {
+    CHECK_EQ(ring_free_.size() + (ring_current_ ? 1 : 0), ring_.size()) <<
+        "Can't change batch_size while batches are streamed.";
+    for (int i = 0; i < ring_.size(); ++i) {
+      ring_[i]->data_.Reshape(batch_size_, channels_, height_, width_);
+      ring_[i]->label_.Reshape(batch_size_, 1, 1, 1);
+    }
+  }
 }
 
 template <typename Dtype>
 void MemoryDataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+  if (!ring_.empty()) {
+    // Share the next full batch with the top blobs, and free the previous
+    // one that they no longer point to.
+    if (ring_current_) {
+      ring_free_.push(ring_current_);
+    }
+    ring_current_ = ring_full_.pop();
+    top[0]->ReshapeLike(ring_current_->data_);
+    top[0]->set_cpu_data(ring_current_->data_.mutable_cpu_data());
+    top[1]->ReshapeLike(ring_current_->label_);
+    top[1]->set_cpu_data(ring_current_->label_.mutable_cpu_data());
+    return;
+  }
   CHECK(data_) << "MemoryDataLayer needs to be initalized by calling Reset";
   top[0]->Reshape(batch_size_, channels_, height_, width_);
   top[1]->Reshape(batch_size_, 1, 1, 1);
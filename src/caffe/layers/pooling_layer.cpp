@@ -131,7 +131,8 @@ template <typename Dtype>
 void PoolingLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   const Dtype* bottom_data = bottom[0]->cpu_data();
-  Dtype* top_data = top[0]->mutable_cpu_data();
+  // Every method below initializes all of the outputs first.
+  Dtype* top_data = top[0]->write_only_cpu_data();
   const int top_count = top[0]->count();
   // We'll output the mask to top[1] if it's of size >1.
   const bool use_top_mask = top.size() > 1;
@@ -143,10 +144,10 @@ void PoolingLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   case PoolingParameter_PoolMethod_MAX:
     // Initialize
     if (use_top_mask) {
-      top_mask = top[1]->mutable_cpu_data();
+      top_mask = top[1]->write_only_cpu_data();
       caffe_set(top_count, Dtype(-1), top_mask);
     } else {
-      mask = max_idx_.mutable_cpu_data();
+      mask = max_idx_.write_only_cpu_data();
       caffe_set(top_count, -1, mask);
     }
     caffe_set(top_count, Dtype(-FLT_MAX), top_data);
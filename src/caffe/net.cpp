@@ -216,6 +216,245 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
   debug_info_ = param.debug_info();
   LOG(INFO) << "Network initialization done.";
   LOG(INFO) << "Memory required for data: " << memory_used_ * sizeof(Dtype);
+  data_memory_planned_ = false;
+  verify_memory_plan_ = false;
+  if (param.plan_memory() && phase_ == TEST) {
+    PlanDataMemory(param);
+  } else if (param.plan_memory()) {
+    verify_memory_plan_ = param.verify_memory_plan();
+    PlanDiffMemory(param);
+  }
+}
+
+// Helper for planning memory: assigns the lifetimes [first, last] of blobs,
+// given in steps of the pass they live through, to as few and as small
+// buffers as it can, such that the lifetimes assigned to a buffer do not
+// overlap. Returns the buffer of each lifetime, and sets the size of each
+// buffer.
+static vector<int> AssignBuffers(const vector<pair<int, int> >& lifetimes,
+    const vector<size_t>& sizes, vector<size_t>* buffer_sizes) {
+  // Visit the lifetimes by start, as the pass does.
+  vector<pair<int, int> > order;
+  for (int i = 0; i < lifetimes.size(); ++i) {
+    order.push_back(make_pair(lifetimes[i].first, i));
+  }
+  std::sort(order.begin(), order.end());
+  vector<int> buffers(lifetimes.size());
+  // The last step each buffer is in use.
+  vector<int> buffer_ends;
+  buffer_sizes->clear();
+  for (int i = 0; i < order.size(); ++i) {
+    const int id = order[i].second;
+    // Take the smallest free buffer that is large enough, or else the
+    // largest free one, which then grows.
+    int best = -1;
+    for (int b = 0; b < buffer_ends.size(); ++b) {
+      if (buffer_ends[b] >= lifetimes[id].first) { continue; }
+      if (best < 0) {
+        best = b;
+      } else if ((*buffer_sizes)[best] >= sizes[id]) {
+        if ((*buffer_sizes)[b] >= sizes[id] &&
+            (*buffer_sizes)[b] < (*buffer_sizes)[best]) {
+          best = b;
+        }
+      } else if ((*buffer_sizes)[b] > (*buffer_sizes)[best]) {
+        best = b;
+      }
+    }
+    if (best < 0) {
+      best = buffer_ends.size();
+      buffer_ends.push_back(0);
+      buffer_sizes->push_back(0);
+    }
+    buffers[id] = best;
+    buffer_ends[best] = lifetimes[id].second;
+    (*buffer_sizes)[best] = std::max((*buffer_sizes)[best], sizes[id]);
+  }
+  return buffers;
+}
+
+template <typename Dtype>
+vector<bool> Net<Dtype>::BlobsToKeep(const NetParameter& param) const {
+  vector<bool> keep(blobs_.size(), false);
+  for (int i = 0; i < net_input_blob_indices_.size(); ++i) {
+    keep[net_input_blob_indices_[i]] = true;
+  }
+  for (int i = 0; i < net_output_blob_indices_.size(); ++i) {
+    keep[net_output_blob_indices_[i]] = true;
+  }
+  for (int i = 0; i < param.keep_blob_size(); ++i) {
+    CHECK(has_blob(param.keep_blob(i)))
+        << "Unknown keep_blob " << param.keep_blob(i);
+    keep[blob_names_index_.find(param.keep_blob(i))->second] = true;
+  }
+  // Data layers point their tops to memory of their own.
+  for (int layer_id = 0; layer_id < layers_.size(); ++layer_id) {
+    if (bottom_id_vecs_[layer_id].empty()) {
+      for (int top_id = 0; top_id < top_id_vecs_[layer_id].size(); ++top_id) {
+        keep[top_id_vecs_[layer_id][top_id]] = true;
+      }
+    }
+  }
+  return keep;
+}
+
+template <typename Dtype>
+vector<shared_ptr<SyncedMemory> > Net<Dtype>::PlanBlobMemory(
+    const vector<int>& owner, const vector<pair<int, int> >& lifetimes,
+    const vector<bool>& keep, const string& what) const {
+  const int num_blobs = blobs_.size();
+  // Plan the memory of the owners that are used and not kept.
+  vector<int> planned(num_blobs, -1);
+  vector<pair<int, int> > planned_lifetimes;
+  vector<size_t> planned_sizes;
+  size_t kept_size = 0;
+  for (int blob_id = 0; blob_id < num_blobs; ++blob_id) {
+    const size_t size = blobs_[blob_id]->count() * sizeof(Dtype);
+    if (owner[blob_id] != blob_id) {
+      const int owner_id = planned[owner[blob_id]];
+      if (owner_id >= 0) {
+        planned_sizes[owner_id] = std::max(planned_sizes[owner_id], size);
+      }
+    } else if (keep[blob_id]) {
+      kept_size += size;
+    } else if (lifetimes[blob_id].first >= 0) {
+      planned[blob_id] = planned_lifetimes.size();
+      planned_lifetimes.push_back(lifetimes[blob_id]);
+      planned_sizes.push_back(size);
+    }
+  }
+  vector<size_t> buffer_sizes;
+  const vector<int> buffers =
+      AssignBuffers(planned_lifetimes, planned_sizes, &buffer_sizes);
+  vector<shared_ptr<SyncedMemory> > memory(buffer_sizes.size());
+  size_t planned_size = 0;
+  for (int b = 0; b < buffer_sizes.size(); ++b) {
+    memory[b].reset(new SyncedMemory(buffer_sizes[b]));
+    planned_size += buffer_sizes[b];
+  }
+  vector<shared_ptr<SyncedMemory> > blob_memory(num_blobs);
+  for (int blob_id = 0; blob_id < num_blobs; ++blob_id) {
+    const int owner_id = planned[owner[blob_id]];
+    if (owner_id >= 0) {
+      blob_memory[blob_id] = memory[buffers[owner_id]];
+    }
+  }
+  LOG(INFO) << "Planned the " << what << " of " << planned_lifetimes.size()
+            << " blobs into " << buffer_sizes.size() << " buffers.";
+  LOG(INFO) << "Memory required for " << what << " after planning: "
+            << kept_size + planned_size;
+  return blob_memory;
+}
+
+template <typename Dtype>
+void Net<Dtype>::PlanDataMemory(const NetParameter& param) {
+  const int num_blobs = blobs_.size();
+  // The blob owning the memory of each blob: tops of layers sharing the data
+  // of their bottom live in the memory of that bottom.
+  vector<int> owner(num_blobs);
+  for (int blob_id = 0; blob_id < num_blobs; ++blob_id) {
+    owner[blob_id] = blob_id;
+  }
+  // The first and last layers using the memory of each owner.
+  vector<pair<int, int> > lifetimes(num_blobs, make_pair(-1, -1));
+  for (int layer_id = 0; layer_id < layers_.size(); ++layer_id) {
+    for (int bottom_id = 0; bottom_id < bottom_id_vecs_[layer_id].size();
+         ++bottom_id) {
+      lifetimes[owner[bottom_id_vecs_[layer_id][bottom_id]]].second =
+          layer_id;
+    }
+    for (int top_id = 0; top_id < top_id_vecs_[layer_id].size(); ++top_id) {
+      const int blob_id = top_id_vecs_[layer_id][top_id];
+      if (layers_[layer_id]->TopsShareBottomData() &&
+          !bottom_id_vecs_[layer_id].empty()) {
+        owner[blob_id] = owner[bottom_id_vecs_[layer_id][0]];
+      }
+      pair<int, int>& lifetime = lifetimes[owner[blob_id]];
+      if (lifetime.first < 0) {
+        lifetime.first = layer_id;
+      }
+      lifetime.second = layer_id;
+    }
+  }
+  vector<bool> keep = BlobsToKeep(param);
+  for (int blob_id = 0; blob_id < num_blobs; ++blob_id) {
+    keep[owner[blob_id]] = keep[owner[blob_id]] || keep[blob_id];
+  }
+  const vector<shared_ptr<SyncedMemory> > memory =
+      PlanBlobMemory(owner, lifetimes, keep, "data");
+  for (int blob_id = 0; blob_id < num_blobs; ++blob_id) {
+    if (memory[blob_id]) {
+      blobs_[blob_id]->ShareDataMemory(memory[blob_id]);
+    }
+  }
+  data_memory_planned_ = true;
+}
+
+template <typename Dtype>
+void Net<Dtype>::PlanDiffMemory(const NetParameter& param) {
+  const int num_blobs = blobs_.size();
+  // The blob owning the diff memory of each blob: bottoms of layers sharing
+  // the diff of their top live in the memory of that top.
+  vector<int> owner(num_blobs);
+  for (int blob_id = 0; blob_id < num_blobs; ++blob_id) {
+    owner[blob_id] = blob_id;
+  }
+  vector<bool> keep = BlobsToKeep(param);
+  // The first and last steps of the backward pass using the diff of each
+  // owner, where step 0 is the backward of the last layer.
+  vector<pair<int, int> > lifetimes(num_blobs, make_pair(-1, -1));
+  for (int layer_id = layers_.size() - 1; layer_id >= 0; --layer_id) {
+    if (!layer_need_backward_[layer_id]) { continue; }
+    const int step = layers_.size() - 1 - layer_id;
+    // Backward reads the diffs of the tops. A diff first used that way is
+    // not computed by the backward pass, like the loss weights of the loss
+    // layers, and must be kept.
+    for (int top_id = 0; top_id < top_id_vecs_[layer_id].size(); ++top_id) {
+      const int blob_id = owner[top_id_vecs_[layer_id][top_id]];
+      if (lifetimes[blob_id].first < 0) {
+        keep[blob_id] = true;
+        lifetimes[blob_id].first = step;
+      }
+      lifetimes[blob_id].second = step;
+    }
+    for (int bottom_id = 0; bottom_id < bottom_id_vecs_[layer_id].size();
+         ++bottom_id) {
+      if (!bottom_need_backward_[layer_id][bottom_id]) { continue; }
+      const int blob_id = bottom_id_vecs_[layer_id][bottom_id];
+      if (layers_[layer_id]->BottomsShareTopDiff()) {
+        owner[blob_id] = owner[top_id_vecs_[layer_id][0]];
+      }
+      pair<int, int>& lifetime = lifetimes[owner[blob_id]];
+      if (lifetime.first < 0) {
+        lifetime.first = step;
+      }
+      lifetime.second = step;
+    }
+  }
+  for (int blob_id = 0; blob_id < num_blobs; ++blob_id) {
+    keep[owner[blob_id]] = keep[owner[blob_id]] || keep[blob_id];
+  }
+  planned_diffs_ = PlanBlobMemory(owner, lifetimes, keep, "diff");
+  if (verify_memory_plan_) {
+    own_diffs_.resize(num_blobs);
+    for (int blob_id = 0; blob_id < num_blobs; ++blob_id) {
+      own_diffs_[blob_id] = blobs_[blob_id]->diff();
+    }
+  }
+  UsePlannedDiffs(true);
+}
+
+template <typename Dtype>
+void Net<Dtype>::UsePlannedDiffs(bool planned) {
+  for (int blob_id = 0; blob_id < planned_diffs_.size(); ++blob_id) {
+    if (!planned_diffs_[blob_id]) { continue; }
+    const shared_ptr<SyncedMemory>& diff =
+        planned ? planned_diffs_[blob_id] : own_diffs_[blob_id];
+    // Blobs reshaped beyond their planned diff have a diff of their own.
+    if (diff->size() >= blobs_[blob_id]->count() * sizeof(Dtype)) {
+      blobs_[blob_id]->ShareDiffMemory(diff);
+    }
+  }
 }
 
 template <typename Dtype>
@@ -533,6 +772,32 @@ template <typename Dtype>
 void Net<Dtype>::BackwardFromTo(int start, int end) {
   CHECK_GE(end, 0);
   CHECK_LT(start, layers_.size());
+  CHECK(!data_memory_planned_)
+      << "Backward needs the data that plan_memory lets go in the forward pass";
+  // The gradients the net computes: those of the parameters and the inputs.
+  vector<Blob<Dtype>*> gradients;
+  vector<shared_ptr<Blob<Dtype> > > expected_gradients;
+  if (verify_memory_plan_) {
+    for (int i = 0; i < params_.size(); ++i) {
+      gradients.push_back(params_[i].get());
+    }
+    gradients.insert(gradients.end(), net_input_blobs_.begin(),
+        net_input_blobs_.end());
+    // Compute them with a diff of its own for every blob first.
+    UsePlannedDiffs(false);
+    for (int i = start; i >= end; --i) {
+      if (layer_need_backward_[i]) {
+        layers_[i]->Backward(
+            top_vecs_[i], bottom_need_backward_[i], bottom_vecs_[i]);
+      }
+    }
+    const bool kReshape = true;
+    for (int i = 0; i < gradients.size(); ++i) {
+      expected_gradients.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+      expected_gradients[i]->CopyFrom(*gradients[i], true, kReshape);
+    }
+    UsePlannedDiffs(true);
+  }
   for (int i = start; i >= end; --i) {
     if (layer_need_backward_[i]) {
       layers_[i]->Backward(
@@ -540,6 +805,19 @@ void Net<Dtype>::BackwardFromTo(int start, int end) {
       if (debug_info_) { BackwardDebugInfo(i); }
     }
   }
+  for (int i = 0; i < expected_gradients.size(); ++i) {
+    const string& name = (i < params_.size()) ? param_display_names_[i] :
+        blob_names_[net_input_blob_indices_[i - params_.size()]];
+    const Dtype* diff = gradients[i]->cpu_diff();
+    const Dtype* expected_diff = expected_gradients[i]->cpu_diff();
+    for (int j = 0; j < gradients[i]->count(); ++j) {
+      const Dtype scale = std::max<Dtype>(1,
+          std::max(fabs(diff[j]), fabs(expected_diff[j])));
+      CHECK_LE(fabs(diff[j] - expected_diff[j]), 1e-4 * scale)
+          << "verify_memory_plan: the gradient of " << name
+          << " differs at " << j << " with the planned diffs";
+    }
+  }
 }
 
 template <typename Dtype>
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 
+#include "caffe/data_layers.hpp"
 #include "caffe/net.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/solver.hpp"
@@ -206,6 +207,16 @@ void Solver<Dtype>::Step(int iters) {
               << result_vec[k] << loss_msg_stream.str();
         }
       }
+      // Show where the data layers spent their time since the last display.
+      const vector<shared_ptr<Layer<Dtype> > >& layers = net_->layers();
+      for (int j = 0; j < layers.size(); ++j) {
+        BasePrefetchingDataLayer<Dtype>* data_layer =
+            dynamic_cast<BasePrefetchingDataLayer<Dtype>*>(layers[j].get());
+        if (data_layer) {
+          data_layer->LogStats();
+          data_layer->ResetStats();
+        }
+      }
     }
     ComputeUpdateValue();
     net_->Update();
@@ -8,7 +8,7 @@ namespace caffe {
 
 SyncedMemory::~SyncedMemory() {
   if (cpu_ptr_ && own_cpu_data_) {
-    CaffeFreeHost(cpu_ptr_);
+    CaffeFreeHost(cpu_ptr_, size_);
   }
 
 #ifndef CPU_ONLY
@@ -76,7 +76,7 @@ const void* SyncedMemory::cpu_data() {
 void SyncedMemory::set_cpu_data(void* data) {
   CHECK(data);
   if (own_cpu_data_) {
-    CaffeFreeHost(cpu_ptr_);
+    CaffeFreeHost(cpu_ptr_, size_);
   }
   cpu_ptr_ = data;
   head_ = HEAD_AT_CPU;
@@ -98,6 +98,15 @@ void* SyncedMemory::mutable_cpu_data() {
   return cpu_ptr_;
 }
 
+void* SyncedMemory::write_only_cpu_data() {
+  if (cpu_ptr_ == NULL) {
+    CaffeMallocHost(&cpu_ptr_, size_);
+    own_cpu_data_ = true;
+  }
+  head_ = HEAD_AT_CPU;
+  return cpu_ptr_;
+}
+
 void* SyncedMemory::mutable_gpu_data() {
 #ifndef CPU_ONLY
   to_gpu();
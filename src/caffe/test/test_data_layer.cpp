@@ -1,3 +1,5 @@
+#include <cstdlib>
+#include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
 
@@ -66,7 +68,7 @@ class DataLayerTest : public MultiDeviceTest<TypeParam> {
     db->Close();
   }
 
-  void TestRead() {
+  void TestRead(int decode_threads = 1, bool compact_batches = false) {
     const Dtype scale = 3;
     LayerParameter param;
     param.set_phase(TRAIN);
@@ -74,6 +76,8 @@ class DataLayerTest : public MultiDeviceTest<TypeParam> {
     data_param->set_batch_size(5);
     data_param->set_source(filename_->c_str());
     data_param->set_backend(backend_);
+    data_param->set_decode_threads(decode_threads);
+    data_param->set_compact_batches(compact_batches);
 
     TransformationParameter* transform_param =
         param.mutable_transform_param();
@@ -102,6 +106,171 @@ class DataLayerTest : public MultiDeviceTest<TypeParam> {
         }
       }
     }
+    // Every forwarded batch was timed.
+    const PrefetchStats& stats = layer.stats();
+    EXPECT_EQ(100, stats.batches);
+    EXPECT_GE(stats.load_time, stats.read_time + stats.transform_time);
+    EXPECT_GE(stats.forward_wait_time, 0);
+    layer.ResetStats();
+    EXPECT_EQ(0, layer.stats().batches);
+  }
+
+  void TestReadParallel() {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(3);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_decode_threads(2);
+    data_param->set_parallel_read(true);
+
+    DataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    // Reader 0 has records 0, 1 and reader 1 has records 2, 3, 4. They take
+    // turns across batches, although 2 workers do not divide the batch size.
+    int record = 0;
+    for (int iter = 0; iter < 10; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      for (int i = 0; i < 3; ++i, ++record) {
+        const int expected = record % 2 == 0 ? (record / 2) % 2 :
+            2 + (record / 2) % 3;
+        EXPECT_EQ(expected, blob_top_label_->cpu_data()[i])
+            << "debug: iter " << iter << " i " << i;
+        for (int j = 0; j < 24; ++j) {
+          EXPECT_EQ(expected, blob_top_data_->cpu_data()[i * 24 + j]);
+        }
+      }
+    }
+  }
+
+  void TestSetUpTwice() {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(3);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_decode_threads(2);
+
+    DataLayer<Dtype> layer(param);
+    // The second SetUp restarts the prefetch thread and the read position.
+    for (int setup = 0; setup < 2; ++setup) {
+      layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+      EXPECT_EQ(blob_top_data_->num(), 3);
+      for (int iter = 0; iter < 4; ++iter) {
+        layer.Forward(blob_bottom_vec_, blob_top_vec_);
+        for (int i = 0; i < 3; ++i) {
+          EXPECT_EQ((iter * 3 + i) % 5, blob_top_label_->cpu_data()[i])
+              << "debug: setup " << setup << " iter " << iter;
+        }
+      }
+    }
+  }
+
+  void TestReadCompactMatches() {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(5);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    TransformationParameter* transform_param =
+        param.mutable_transform_param();
+    transform_param->set_scale(0.5);
+    transform_param->set_crop_size(2);
+    transform_param->set_mirror(true);
+    transform_param->add_mean_value(1);
+    transform_param->add_mean_value(3);
+
+    // With the same seed, bytes centered and scaled by Forward must match
+    // the batches transformed in full by the prefetch thread.
+    vector<vector<Dtype> > expected;
+    for (int compact = 0; compact < 2; ++compact) {
+      data_param->set_compact_batches(compact);
+      Caffe::set_random_seed(seed_);
+      DataLayer<Dtype> layer(param);
+      layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+      for (int iter = 0; iter < 5; ++iter) {
+        layer.Forward(blob_bottom_vec_, blob_top_vec_);
+        const Dtype* data = blob_top_data_->cpu_data();
+        if (!compact) {
+          expected.push_back(
+              vector<Dtype>(data, data + blob_top_data_->count()));
+          continue;
+        }
+        for (int i = 0; i < blob_top_data_->count(); ++i) {
+          EXPECT_EQ(expected[iter][i], data[i]) << "debug: iter " << iter;
+        }
+      }
+    }
+  }
+
+  void TestReadShard() {
+    const int num_shards = 2;
+    for (int shard_id = 0; shard_id < num_shards; ++shard_id) {
+      LayerParameter param;
+      param.set_phase(TRAIN);
+      DataParameter* data_param = param.mutable_data_param();
+      data_param->set_batch_size(4);
+      data_param->set_source(filename_->c_str());
+      data_param->set_backend(backend_);
+      data_param->set_num_shards(num_shards);
+      data_param->set_shard_id(shard_id);
+
+      DataLayer<Dtype> layer(param);
+      layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+      // Of the 5 records, shard 0 sees 0, 1 and shard 1 sees 2, 3, 4.
+      const int shard_begin = shard_id == 0 ? 0 : 2;
+      const int shard_size = shard_id == 0 ? 2 : 3;
+      int record = 0;
+      for (int iter = 0; iter < 10; ++iter) {
+        layer.Forward(blob_bottom_vec_, blob_top_vec_);
+        for (int i = 0; i < 4; ++i) {
+          EXPECT_EQ(shard_begin + record % shard_size,
+                    blob_top_label_->cpu_data()[i]);
+          ++record;
+        }
+      }
+    }
+  }
+
+  void TestReadShuffle(int shuffle_block, const string& key_index) {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(5);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_shuffle(true);
+    data_param->set_shuffle_block(shuffle_block);
+    data_param->set_key_index(key_index);
+
+    DataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    // Each batch is one epoch, hence a permutation of the 5 records.
+    bool reordered = false;
+    for (int iter = 0; iter < 10; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      vector<int> position(5, -1);
+      for (int i = 0; i < 5; ++i) {
+        const int label = blob_top_label_->cpu_data()[i];
+        ASSERT_GE(label, 0);
+        ASSERT_LT(label, 5);
+        EXPECT_EQ(-1, position[label]);
+        position[label] = i;
+        reordered |= label != i;
+        for (int j = 0; j < 24; ++j) {
+          EXPECT_EQ(label, blob_top_data_->cpu_data()[i * 24 + j]);
+        }
+      }
+      if (shuffle_block == 2) {
+        // Records 0, 1 and records 2, 3 stay together.
+        EXPECT_EQ(1, std::abs(position[0] - position[1]));
+        EXPECT_EQ(1, std::abs(position[2] - position[3]));
+      }
+    }
+    EXPECT_TRUE(reordered);
   }
 
   void TestReshape(DataParameter_DB backend) {
@@ -354,6 +523,81 @@ TYPED_TEST(DataLayerTest, TestReadLevelDB) {
   this->TestRead();
 }
 
+TYPED_TEST(DataLayerTest, TestReadParallelDecodeLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestRead(3);
+}
+
+TYPED_TEST(DataLayerTest, TestReadParallelReadLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestReadParallel();
+}
+
+TYPED_TEST(DataLayerTest, TestSetUpTwiceLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestSetUpTwice();
+}
+
+TYPED_TEST(DataLayerTest, TestReadCompactLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestRead(1, true);
+}
+
+TYPED_TEST(DataLayerTest, TestReadShardLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestReadShard();
+}
+
+TYPED_TEST(DataLayerTest, TestReadShuffleLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestReadShuffle(0, "");
+}
+
+TYPED_TEST(DataLayerTest, TestReadShuffleBlockLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestReadShuffle(2, "");
+}
+
+TYPED_TEST(DataLayerTest, TestReadShuffleKeyIndexLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  string key_index;
+  MakeTempDir(&key_index);
+  key_index += "/keys";
+  // The first layer writes the index, the second reads it back.
+  this->TestReadShuffle(0, key_index);
+  this->TestReadShuffle(0, key_index);
+}
+
+TYPED_TEST(DataLayerTest, TestReadShuffleStaleKeyIndexLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  string key_index;
+  MakeTempDir(&key_index);
+  key_index += "/keys";
+  {
+    // An index of another DB, which must be rebuilt.
+    std::ofstream outfile(key_index.c_str());
+    outfile << "0\n1\n";
+  }
+  this->TestReadShuffle(0, key_index);
+  std::ifstream infile(key_index.c_str());
+  int num_keys = 0;
+  string key;
+  while (std::getline(infile, key)) {
+    EXPECT_EQ(num_keys, atoi(key.c_str()));
+    ++num_keys;
+  }
+  EXPECT_EQ(5, num_keys);
+}
+
 TYPED_TEST(DataLayerTest, TestReshapeLevelDB) {
   this->TestReshape(DataParameter_DB_LEVELDB);
 }
@@ -392,6 +636,65 @@ TYPED_TEST(DataLayerTest, TestReadLMDB) {
   this->TestRead();
 }
 
+TYPED_TEST(DataLayerTest, TestReadParallelDecodeLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestRead(3);
+}
+
+TYPED_TEST(DataLayerTest, TestReadParallelReadLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestReadParallel();
+}
+
+TYPED_TEST(DataLayerTest, TestSetUpTwiceLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestSetUpTwice();
+}
+
+TYPED_TEST(DataLayerTest, TestReadCompactLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestRead(2, true);
+}
+
+TYPED_TEST(DataLayerTest, TestReadCompactMatchesLMDB) {
+  const bool unique_pixels = true;  // all images the same; pixels different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestReadCompactMatches();
+}
+
+TYPED_TEST(DataLayerTest, TestReadShardLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestReadShard();
+}
+
+TYPED_TEST(DataLayerTest, TestReadShuffleLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestReadShuffle(0, "");
+}
+
+TYPED_TEST(DataLayerTest, TestReadShuffleBlockLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestReadShuffle(2, "");
+}
+
+TYPED_TEST(DataLayerTest, TestReadShuffleKeyIndexLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  string key_index;
+  MakeTempDir(&key_index);
+  key_index += "/keys";
+  // The first layer writes the index, the second reads it back.
+  this->TestReadShuffle(0, key_index);
+  this->TestReadShuffle(0, key_index);
+}
+
 TYPED_TEST(DataLayerTest, TestReshapeLMDB) {
   this->TestReshape(DataParameter_DB_LMDB);
 }
@@ -424,4 +727,16 @@ TYPED_TEST(DataLayerTest, TestReadCropTestLMDB) {
   this->TestReadCrop(TEST);
 }
 
+TYPED_TEST(DataLayerTest, TestReadRecordFile) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_RECORDFILE);
+  this->TestRead();
+}
+
+TYPED_TEST(DataLayerTest, TestReadShuffleRecordFile) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_RECORDFILE);
+  this->TestReadShuffle(0, "");
+}
+
 }  // namespace caffe
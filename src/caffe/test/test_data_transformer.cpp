@@ -1,3 +1,5 @@
+#include <opencv2/core/core.hpp>
+
 #include <string>
 #include <vector>
 
@@ -352,4 +354,93 @@ TYPED_TEST(DataTransformTest, TestMeanFile) {
   }
 }
 
+TYPED_TEST(DataTransformTest, TestCropMirrorMeanFileScale) {
+  TransformationParameter transform_param;
+  const bool unique_pixels = true;  // pixels are consecutive ints [0,size]
+  const int label = 0;
+  const int channels = 3;
+  const int height = 6;
+  const int width = 7;
+  const int crop_size = 4;
+  const int size = channels * height * width;
+  const TypeParam scale = 0.5;
+
+  string mean_file;
+  MakeTempFilename(&mean_file);
+  BlobProto blob_mean;
+  blob_mean.set_num(1);
+  blob_mean.set_channels(channels);
+  blob_mean.set_height(height);
+  blob_mean.set_width(width);
+  for (int j = 0; j < size; ++j) {
+    blob_mean.add_data(j % 5);
+  }
+  WriteProtoToBinaryFile(blob_mean, mean_file);
+
+  transform_param.set_mean_file(mean_file);
+  transform_param.set_crop_size(crop_size);
+  transform_param.set_mirror(true);
+  transform_param.set_scale(scale);
+  Datum datum;
+  FillDatum(label, channels, height, width, unique_pixels, &datum);
+  Blob<TypeParam> blob(1, channels, crop_size, crop_size);
+  DataTransformer<TypeParam> transformer(transform_param, TEST);
+  transformer.InitRand();
+  // The crop is centered in TEST, but the mirror is random.
+  const int h_off = (height - crop_size) / 2;
+  const int w_off = (width - crop_size) / 2;
+  for (int iter = 0; iter < 10; ++iter) {
+    transformer.Transform(datum, &blob);
+    const bool mirrored = blob.cpu_data()[0] !=
+        (w_off + h_off * width - (w_off + h_off * width) % 5) * scale;
+    for (int c = 0; c < channels; ++c) {
+      for (int h = 0; h < crop_size; ++h) {
+        for (int w = 0; w < crop_size; ++w) {
+          const int data_w = mirrored ? crop_size - 1 - w : w;
+          const int index = (c * height + h_off + h) * width + w_off + data_w;
+          EXPECT_EQ((index - index % 5) * scale,
+              blob.cpu_data()[blob.offset(0, c, h, w)]);
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestMatMatchesDatum) {
+  TransformationParameter transform_param;
+  const bool unique_pixels = true;  // pixels are consecutive ints [0,size]
+  const int label = 0;
+  const int channels = 3;
+  const int height = 6;
+  const int width = 7;
+  const int crop_size = 4;
+
+  transform_param.add_mean_value(1);
+  transform_param.add_mean_value(2);
+  transform_param.add_mean_value(3);
+  transform_param.set_crop_size(crop_size);
+  transform_param.set_scale(2);
+  Datum datum;
+  FillDatum(label, channels, height, width, unique_pixels, &datum);
+  // The same image, interleaved.
+  cv::Mat cv_img(height, width, CV_8UC3);
+  for (int h = 0; h < height; ++h) {
+    uchar* ptr = cv_img.ptr<uchar>(h);
+    for (int w = 0; w < width; ++w) {
+      for (int c = 0; c < channels; ++c) {
+        ptr[w * channels + c] = datum.data()[(c * height + h) * width + w];
+      }
+    }
+  }
+  Blob<TypeParam> datum_blob(1, channels, crop_size, crop_size);
+  Blob<TypeParam> mat_blob(1, channels, crop_size, crop_size);
+  DataTransformer<TypeParam> transformer(transform_param, TEST);
+  transformer.InitRand();
+  transformer.Transform(datum, &datum_blob);
+  transformer.Transform(cv_img, &mat_blob);
+  for (int j = 0; j < datum_blob.count(); ++j) {
+    EXPECT_EQ(datum_blob.cpu_data()[j], mat_blob.cpu_data()[j]);
+  }
+}
+
 }  // namespace caffe
@@ -1,4 +1,5 @@
 #include <string>
+#include <vector>
 
 #include "boost/scoped_ptr.hpp"
 #include "gtest/gtest.h"
@@ -56,8 +57,13 @@ struct TypeLMDB {
 };
 DataParameter_DB TypeLMDB::backend = DataParameter_DB_LMDB;
 
+struct TypeRecordFile {
+  static DataParameter_DB backend;
+};
+DataParameter_DB TypeRecordFile::backend = DataParameter_DB_RECORDFILE;
+
 // typedef ::testing::Types<TypeLmdb> TestTypes;
-typedef ::testing::Types<TypeLevelDB, TypeLMDB> TestTypes;
+typedef ::testing::Types<TypeLevelDB, TypeLMDB, TypeRecordFile> TestTypes;
 
 TYPED_TEST_CASE(DBTest, TestTypes);
 
@@ -116,6 +122,96 @@ TYPED_TEST(DBTest, TestKeyValue) {
   EXPECT_FALSE(cursor->valid());
 }
 
+TYPED_TEST(DBTest, TestValueView) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::READ);
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  while (cursor->valid()) {
+    const string value = cursor->value();
+    EXPECT_EQ(value, string(static_cast<const char*>(cursor->value_data()),
+        cursor->value_size()));
+    Datum datum, view_datum;
+    EXPECT_TRUE(datum.ParseFromString(value));
+    EXPECT_TRUE(view_datum.ParseFromArray(cursor->value_data(),
+        cursor->value_size()));
+    EXPECT_EQ(datum.SerializeAsString(), view_datum.SerializeAsString());
+    cursor->Next();
+  }
+}
+
+TYPED_TEST(DBTest, TestShardCursor) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::READ);
+  vector<string> keys0(1, "cat.jpg");
+  vector<string> keys1(1, "fish-bike.jpg");
+  scoped_ptr<db::Cursor> shard0(new db::ShardCursor(db->NewCursor(), keys0));
+  scoped_ptr<db::Cursor> shard1(new db::ShardCursor(db->NewCursor(), keys1));
+  EXPECT_TRUE(shard0->valid());
+  EXPECT_EQ(shard0->key(), "cat.jpg");
+  EXPECT_TRUE(shard1->valid());
+  EXPECT_EQ(shard1->key(), "fish-bike.jpg");
+  shard0->Next();
+  shard1->Next();
+  EXPECT_FALSE(shard0->valid());
+  EXPECT_FALSE(shard1->valid());
+  shard1->SeekToFirst();
+  EXPECT_TRUE(shard1->valid());
+  EXPECT_EQ(shard1->key(), "fish-bike.jpg");
+  // Seek stays within the shard.
+  EXPECT_FALSE(shard1->Seek("cat.jpg"));
+  EXPECT_FALSE(shard1->valid());
+  EXPECT_TRUE(shard1->Seek("fish-bike.jpg"));
+  EXPECT_TRUE(shard1->valid());
+  shard1->Next();
+  EXPECT_FALSE(shard1->valid());
+  scoped_ptr<db::Cursor> shard2(
+      new db::ShardCursor(db->NewCursor(), vector<string>()));
+  EXPECT_FALSE(shard2->valid());
+}
+
+TYPED_TEST(DBTest, TestSeek) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::READ);
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  EXPECT_TRUE(cursor->Seek("fish-bike.jpg"));
+  EXPECT_EQ(cursor->key(), "fish-bike.jpg");
+  EXPECT_TRUE(cursor->Seek("cat.jpg"));
+  EXPECT_EQ(cursor->key(), "cat.jpg");
+  EXPECT_FALSE(cursor->Seek("dog.jpg"));
+}
+
+TYPED_TEST(DBTest, TestShuffleCursor) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::READ);
+  vector<string> keys;
+  keys.push_back("cat.jpg");
+  keys.push_back("fish-bike.jpg");
+  scoped_ptr<db::Cursor> cursor(
+      new db::ShuffleCursor(db->NewCursor(), keys, 0, 1701));
+  for (int pass = 0; pass < 10; ++pass) {
+    EXPECT_TRUE(cursor->valid());
+    const string first = cursor->key();
+    cursor->Next();
+    EXPECT_TRUE(cursor->valid());
+    const string second = cursor->key();
+    EXPECT_NE(first, second);
+    EXPECT_TRUE(first == "cat.jpg" || first == "fish-bike.jpg");
+    EXPECT_TRUE(second == "cat.jpg" || second == "fish-bike.jpg");
+    cursor->Next();
+    EXPECT_FALSE(cursor->valid());
+    cursor->SeekToFirst();
+    // Seek continues the pass from the key found.
+    const string next_first = cursor->key();
+    EXPECT_TRUE(cursor->Seek(first));
+    EXPECT_EQ(first, cursor->key());
+    cursor->Next();
+    EXPECT_EQ(first == next_first, cursor->valid());
+    cursor->SeekToFirst();
+  }
+  EXPECT_FALSE(cursor->Seek("dog.jpg"));
+  EXPECT_FALSE(cursor->valid());
+}
+
 TYPED_TEST(DBTest, TestWrite) {
   scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
   db->Open(this->source_, db::WRITE);
@@ -131,4 +227,102 @@ TYPED_TEST(DBTest, TestWrite) {
   txn->Commit();
 }
 
+TYPED_TEST(DBTest, TestSortedWrite) {
+  string source;
+  MakeTempDir(&source);
+  source += "/db";
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(source, db::NEW);
+  db->set_sorted_writes(true);
+  scoped_ptr<db::Transaction> txn(db->NewTransaction());
+  const char* keys[] = {"00000000_a", "00000001_b", "00000002_c"};
+  for (int i = 0; i < 3; ++i) {
+    txn->Put(keys[i], keys[i]);
+  }
+  txn->Commit();
+  db->Close();
+  db->Open(source, db::READ);
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(cursor->valid());
+    EXPECT_EQ(keys[i], cursor->key());
+    EXPECT_EQ(keys[i], cursor->value());
+    cursor->Next();
+  }
+  EXPECT_FALSE(cursor->valid());
+}
+
+TEST(RecordDBTest, TestParallelWriters) {
+  string source;
+  MakeTempDir(&source);
+  source += "/db";
+  // Each writer claims its own shard.
+  scoped_ptr<db::DB> writer0(db::GetDB("recordfile"));
+  scoped_ptr<db::DB> writer1(db::GetDB("recordfile"));
+  writer0->Open(source, db::NEW);
+  writer1->Open(source, db::WRITE);
+  scoped_ptr<db::Transaction> txn0(writer0->NewTransaction());
+  scoped_ptr<db::Transaction> txn1(writer1->NewTransaction());
+  for (int i = 0; i < 3; ++i) {
+    txn0->Put(string(1, '0' + i), "shard0");
+    txn1->Put(string(1, '0' + i + 3), "shard1");
+  }
+  txn1->Commit();
+  txn0->Put("6", "shard0");
+  txn0->Commit();
+  writer0->Close();
+  writer1->Close();
+
+  scoped_ptr<db::DB> db(db::GetDB("recordfile"));
+  db->Open(source, db::READ);
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  const int expected_keys[] = {0, 1, 2, 6, 3, 4, 5};
+  for (int i = 0; i < 7; ++i) {
+    ASSERT_TRUE(cursor->valid());
+    EXPECT_EQ(string(1, '0' + expected_keys[i]), cursor->key());
+    EXPECT_EQ(expected_keys[i] < 3 || expected_keys[i] == 6 ?
+        "shard0" : "shard1", cursor->value());
+    cursor->Next();
+  }
+  EXPECT_FALSE(cursor->valid());
+  EXPECT_TRUE(cursor->Seek("4"));
+  EXPECT_EQ("shard1", cursor->value());
+  cursor->Next();
+  EXPECT_EQ("5", cursor->key());
+}
+
+TEST(RecordDBTest, TestSeekUnsortedKeys) {
+  string source;
+  MakeTempDir(&source);
+  source += "/db";
+  const char* keys[] = {"b", "ab", "a", "ba", "c"};
+  scoped_ptr<db::DB> writer(db::GetDB("recordfile"));
+  writer->Open(source, db::NEW);
+  scoped_ptr<db::Transaction> txn(writer->NewTransaction());
+  for (int i = 0; i < 5; ++i) {
+    txn->Put(keys[i], string(1, '0' + i));
+  }
+  txn->Commit();
+  writer->Close();
+
+  // The cursors share one index of the keys.
+  scoped_ptr<db::DB> db(db::GetDB("recordfile"));
+  db->Open(source, db::READ);
+  scoped_ptr<db::Cursor> cursor0(db->NewCursor());
+  scoped_ptr<db::Cursor> cursor1(db->NewCursor());
+  for (int i = 4; i >= 0; --i) {
+    db::Cursor* cursor = i % 2 ? cursor1.get() : cursor0.get();
+    ASSERT_TRUE(cursor->Seek(keys[i]));
+    EXPECT_EQ(keys[i], cursor->key());
+    EXPECT_EQ(string(1, '0' + i), cursor->value());
+  }
+  EXPECT_FALSE(cursor0->Seek("aa"));
+  EXPECT_FALSE(cursor0->valid());
+  EXPECT_FALSE(cursor1->Seek(""));
+  EXPECT_FALSE(cursor1->Seek("bb"));
+  EXPECT_TRUE(cursor1->Seek("ab"));
+  cursor1->Next();
+  EXPECT_EQ("a", cursor1->key());
+}
+
 }  // namespace caffe
@@ -117,4 +117,106 @@ TYPED_TEST(HDF5OutputLayerTest, TestForward) {
       this->output_file_name_;
 }
 
+TYPED_TEST(HDF5OutputLayerTest, TestForwardAppend) {
+  typedef typename TypeParam::Dtype Dtype;
+  hid_t file_id = H5Fopen(this->input_file_name_.c_str(), H5F_ACC_RDONLY,
+                          H5P_DEFAULT);
+  ASSERT_GE(file_id, 0)<< "Failed to open HDF5 file" <<
+      this->input_file_name_;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_DATASET_NAME, 0, 4,
+                       this->blob_data_);
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_LABEL_NAME, 0, 4,
+                       this->blob_label_);
+  herr_t status = H5Fclose(file_id);
+  EXPECT_GE(status, 0)<< "Failed to close HDF5 file " <<
+      this->input_file_name_;
+  this->blob_bottom_vec_.push_back(this->blob_data_);
+  this->blob_bottom_vec_.push_back(this->blob_label_);
+
+  // Write more batches than can be queued at once.
+  const int num_batches = 5;
+  LayerParameter param;
+  param.mutable_hdf5_output_param()->set_file_name(this->output_file_name_);
+  param.mutable_hdf5_output_param()->set_queue_size(2);
+  {
+    HDF5OutputLayer<Dtype> layer(param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int i = 0; i < num_batches; ++i) {
+      layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    }
+  }
+  file_id = H5Fopen(this->output_file_name_.c_str(), H5F_ACC_RDONLY,
+                    H5P_DEFAULT);
+  ASSERT_GE(file_id, 0) << "Failed to open HDF5 file" <<
+      this->output_file_name_;
+  Blob<Dtype> blob_data;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_DATASET_NAME, 0, 4, &blob_data);
+  Blob<Dtype> blob_label;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_LABEL_NAME, 0, 4, &blob_label);
+  status = H5Fclose(file_id);
+  EXPECT_GE(status, 0) << "Failed to close HDF5 file " <<
+      this->output_file_name_;
+
+  // The batches are appended one after another.
+  ASSERT_EQ(blob_data.num(), num_batches * this->blob_data_->num());
+  ASSERT_EQ(blob_label.num(), num_batches * this->blob_label_->num());
+  const int data_count = this->blob_data_->count();
+  const int label_count = this->blob_label_->count();
+  for (int i = 0; i < blob_data.count(); ++i) {
+    EXPECT_EQ(this->blob_data_->cpu_data()[i % data_count],
+        blob_data.cpu_data()[i]);
+  }
+  for (int i = 0; i < blob_label.count(); ++i) {
+    EXPECT_EQ(this->blob_label_->cpu_data()[i % label_count],
+        blob_label.cpu_data()[i]);
+  }
+}
+
+TYPED_TEST(HDF5OutputLayerTest, TestSetUpTwice) {
+  typedef typename TypeParam::Dtype Dtype;
+  hid_t file_id = H5Fopen(this->input_file_name_.c_str(), H5F_ACC_RDONLY,
+                          H5P_DEFAULT);
+  ASSERT_GE(file_id, 0)<< "Failed to open HDF5 file" <<
+      this->input_file_name_;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_DATASET_NAME, 0, 4,
+                       this->blob_data_);
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_LABEL_NAME, 0, 4,
+                       this->blob_label_);
+  herr_t status = H5Fclose(file_id);
+  EXPECT_GE(status, 0)<< "Failed to close HDF5 file " <<
+      this->input_file_name_;
+  this->blob_bottom_vec_.push_back(this->blob_data_);
+  this->blob_bottom_vec_.push_back(this->blob_label_);
+
+  // A second SetUp finishes the first file and starts over, even with
+  // batches still queued for the writer.
+  LayerParameter param;
+  param.mutable_hdf5_output_param()->set_file_name(this->output_file_name_);
+  param.mutable_hdf5_output_param()->set_queue_size(2);
+  {
+    HDF5OutputLayer<Dtype> layer(param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int i = 0; i < 3; ++i) {
+      layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    }
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  }
+  file_id = H5Fopen(this->output_file_name_.c_str(), H5F_ACC_RDONLY,
+                    H5P_DEFAULT);
+  ASSERT_GE(file_id, 0) << "Failed to open HDF5 file" <<
+      this->output_file_name_;
+  Blob<Dtype> blob_data;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_DATASET_NAME, 0, 4, &blob_data);
+  Blob<Dtype> blob_label;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_LABEL_NAME, 0, 4, &blob_label);
+  status = H5Fclose(file_id);
+  EXPECT_GE(status, 0) << "Failed to close HDF5 file " <<
+      this->output_file_name_;
+
+  // Only the batch written after the second SetUp remains.
+  this->CheckBlobEqual(*(this->blob_data_), blob_data);
+  this->CheckBlobEqual(*(this->blob_label_), blob_label);
+}
+
 }  // namespace caffe
@@ -132,4 +132,76 @@ TYPED_TEST(HDF5DataLayerTest, TestRead) {
   }
 }
 
+TYPED_TEST(HDF5DataLayerTest, TestReadWindowed) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  param.add_top("data");
+  param.add_top("label");
+  param.add_top("label2");
+
+  HDF5DataParameter* hdf5_data_param = param.mutable_hdf5_data_param();
+  int batch_size = 5;
+  hdf5_data_param->set_batch_size(batch_size);
+  hdf5_data_param->set_source(*(this->filename));
+  // Windows of 3 rows straddle the batches and the end of each file.
+  hdf5_data_param->set_window_size(3);
+  HDF5DataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+
+  // The rows come out in the same order as when reading whole files.
+  const int data_size = 8 * 6 * 5;
+  for (int iter = 0; iter < 10; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    int label_offset = 1 + ((iter % 2 == 0) ? 0 : batch_size);
+    int data_offset = (iter % 2 == 0) ? 0 : batch_size * data_size;
+    int file_offset = (iter % 4 < 2) ? 0 : 2400;
+    for (int i = 0; i < batch_size; ++i) {
+      EXPECT_EQ(label_offset + i, this->blob_top_label_->cpu_data()[i]);
+      EXPECT_EQ(label_offset + 1 + i, this->blob_top_label2_->cpu_data()[i]);
+    }
+    for (int idx = 0; idx < batch_size * data_size; ++idx) {
+      EXPECT_EQ(file_offset + data_offset + idx,
+          this->blob_top_data_->cpu_data()[idx]) << "iter " << iter;
+    }
+  }
+}
+
+TYPED_TEST(HDF5DataLayerTest, TestShuffleWindowed) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  param.add_top("data");
+  param.add_top("label");
+
+  HDF5DataParameter* hdf5_data_param = param.mutable_hdf5_data_param();
+  int batch_size = 5;
+  hdf5_data_param->set_batch_size(batch_size);
+  hdf5_data_param->set_source(*(this->filename));
+  hdf5_data_param->set_window_size(batch_size);
+  hdf5_data_param->set_shuffle(true);
+  HDF5DataLayer<Dtype> layer(param);
+  vector<Blob<Dtype>*> top_vec(this->blob_top_vec_.begin(),
+      this->blob_top_vec_.begin() + 2);
+  layer.SetUp(this->blob_bottom_vec_, top_vec);
+
+  // Each batch is one window: its rows in some order, with matching data.
+  const int data_size = 8 * 6 * 5;
+  for (int iter = 0; iter < 8; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, top_vec);
+    int label_offset = 1 + ((iter % 2 == 0) ? 0 : batch_size);
+    vector<int> seen(batch_size, 0);
+    for (int i = 0; i < batch_size; ++i) {
+      const int row = this->blob_top_label_->cpu_data()[i] - label_offset;
+      ASSERT_GE(row, 0);
+      ASSERT_LT(row, batch_size);
+      ++seen[row];
+      const Dtype first = this->blob_top_data_->cpu_data()[i * data_size];
+      EXPECT_EQ(0, static_cast<int>(first - (label_offset - 1 + row)
+          * data_size) % 2400);
+    }
+    for (int i = 0; i < batch_size; ++i) {
+      EXPECT_EQ(1, seen[i]);
+    }
+  }
+}
+
 }  // namespace caffe
@@ -0,0 +1,100 @@
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/syncedmem.hpp"
+#include "caffe/util/host_allocator.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class HostAllocatorTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    HostAllocator::Get().Trim();
+  }
+};
+
+TEST_F(HostAllocatorTest, TestClassSize) {
+  EXPECT_EQ(HostAllocator::ClassSize(0), 64);
+  EXPECT_EQ(HostAllocator::ClassSize(64), 64);
+  EXPECT_EQ(HostAllocator::ClassSize(65), 80);
+  EXPECT_EQ(HostAllocator::ClassSize(128), 128);
+  EXPECT_EQ(HostAllocator::ClassSize(129), 160);
+  EXPECT_EQ(HostAllocator::ClassSize(1000), 1024);
+  EXPECT_EQ(HostAllocator::ClassSize(1025), 1280);
+}
+
+TEST_F(HostAllocatorTest, TestReuse) {
+  HostAllocator& allocator = HostAllocator::Get();
+  const HostAllocator::Stats before = allocator.stats();
+  void* ptr = allocator.Allocate(1000);
+  allocator.Free(ptr, 1000);
+  EXPECT_EQ(allocator.stats().bytes_cached, 1024);
+  // A request of the same size class gets the freed buffer back.
+  void* other = allocator.Allocate(1010);
+  EXPECT_EQ(other, ptr);
+  const HostAllocator::Stats after = allocator.stats();
+  EXPECT_EQ(after.allocations - before.allocations, 2);
+  EXPECT_EQ(after.cache_hits - before.cache_hits, 1);
+  EXPECT_EQ(after.bytes_cached, 0);
+  allocator.Free(other, 1010);
+  allocator.Trim();
+  EXPECT_EQ(allocator.stats().bytes_cached, 0);
+  EXPECT_EQ(allocator.stats().bytes_in_use, before.bytes_in_use);
+}
+
+TEST_F(HostAllocatorTest, TestCacheLimit) {
+  HostAllocator& allocator = HostAllocator::Get();
+  const size_t limit = allocator.cache_limit();
+  allocator.set_cache_limit(2048);
+  void* ptrs[3];
+  for (int i = 0; i < 3; ++i) {
+    ptrs[i] = allocator.Allocate(1024);
+  }
+  for (int i = 0; i < 3; ++i) {
+    allocator.Free(ptrs[i], 1024);
+  }
+  // Only the buffers fitting in the limit are kept.
+  EXPECT_EQ(allocator.stats().bytes_cached, 2048);
+  // Lowering the limit only evicts down to it.
+  allocator.set_cache_limit(1024);
+  EXPECT_LE(allocator.stats().bytes_cached, 1024);
+  EXPECT_GT(allocator.stats().bytes_cached, 0);
+  allocator.set_cache_limit(limit);
+}
+
+TEST_F(HostAllocatorTest, TestAlignment) {
+  HostAllocator& allocator = HostAllocator::Get();
+  const size_t sizes[] = {1, 100, 1000, 12345};
+  for (int i = 0; i < 4; ++i) {
+    void* ptr = allocator.Allocate(sizes[i]);
+    EXPECT_EQ(reinterpret_cast<size_t>(ptr) % HostAllocator::kAlignment, 0);
+    allocator.Free(ptr, sizes[i]);
+  }
+}
+
+TEST_F(HostAllocatorTest, TestHugePageAlignment) {
+  HostAllocator& allocator = HostAllocator::Get();
+  const size_t threshold = allocator.huge_page_threshold();
+  allocator.set_huge_page_threshold(HostAllocator::kHugePageSize);
+  const size_t size = 2 * HostAllocator::kHugePageSize;
+  void* ptr = allocator.Allocate(size);
+  EXPECT_EQ(reinterpret_cast<size_t>(ptr) % HostAllocator::kHugePageSize, 0);
+  // The buffer is usable whether or not the kernel backs it by huge pages.
+  caffe_memset(size, 1, ptr);
+  allocator.Free(ptr, size);
+  allocator.set_huge_page_threshold(threshold);
+}
+
+TEST_F(HostAllocatorTest, TestSyncedMemoryReuse) {
+  void* cpu_data;
+  {
+    SyncedMemory mem(1000);
+    cpu_data = mem.mutable_cpu_data();
+  }
+  SyncedMemory mem(1000);
+  EXPECT_EQ(mem.mutable_cpu_data(), cpu_data);
+}
+
+}  // namespace caffe
@@ -0,0 +1,55 @@
+#include <opencv2/core/core.hpp>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/image_cache.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class ImageCacheTest : public ::testing::Test {};
+
+TEST_F(ImageCacheTest, TestGetPut) {
+  // Room for exactly two 4x4 color images.
+  ImageCache cache(2 * 4 * 4 * 3);
+  cv::Mat image(4, 4, CV_8UC3);
+  cv::Mat cached;
+  EXPECT_FALSE(cache.Get("a", &cached));
+  EXPECT_FALSE(cache.Contains("a"));
+  cache.Put("a", image);
+  EXPECT_TRUE(cache.Contains("a"));
+  EXPECT_EQ(cache.size(), 4 * 4 * 3);
+  ASSERT_TRUE(cache.Get("a", &cached));
+  // The cached image shares the pixels of the original.
+  EXPECT_EQ(cached.data, image.data);
+  EXPECT_EQ(cached.rows, 4);
+  EXPECT_EQ(cached.cols, 4);
+}
+
+TEST_F(ImageCacheTest, TestEvictLeastRecentlyUsed) {
+  ImageCache cache(2 * 4 * 4 * 3);
+  cv::Mat cached;
+  cache.Put("a", cv::Mat(4, 4, CV_8UC3));
+  cache.Put("b", cv::Mat(4, 4, CV_8UC3));
+  // Touch a, so that b is the least recently used.
+  EXPECT_TRUE(cache.Get("a", &cached));
+  cache.Put("c", cv::Mat(4, 4, CV_8UC3));
+  EXPECT_TRUE(cache.Get("a", &cached));
+  EXPECT_FALSE(cache.Get("b", &cached));
+  EXPECT_TRUE(cache.Get("c", &cached));
+  EXPECT_EQ(cache.size(), cache.capacity());
+}
+
+TEST_F(ImageCacheTest, TestSkipOversize) {
+  ImageCache cache(4 * 4 * 3);
+  cv::Mat cached;
+  cache.Put("a", cv::Mat(4, 4, CV_8UC3));
+  cache.Put("b", cv::Mat(8, 8, CV_8UC3));
+  EXPECT_FALSE(cache.Get("b", &cached));
+  // The oversize image does not evict the ones already cached.
+  EXPECT_TRUE(cache.Get("a", &cached));
+}
+
+}  // namespace caffe
@@ -87,6 +87,30 @@ TYPED_TEST(ImageDataLayerTest, TestRead) {
   }
 }
 
+TYPED_TEST(ImageDataLayerTest, TestReadCachedReadahead) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  ImageDataParameter* image_data_param = param.mutable_image_data_param();
+  // Batches that straddle the end of the list, to wrap the readahead.
+  image_data_param->set_batch_size(3);
+  image_data_param->set_source(this->filename_.c_str());
+  image_data_param->set_shuffle(false);
+  image_data_param->set_readahead(4);
+  image_data_param->set_cache_bytes(2 * 360 * 480 * 3);
+  ImageDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(this->blob_top_data_->num(), 3);
+  EXPECT_EQ(this->blob_top_data_->height(), 360);
+  EXPECT_EQ(this->blob_top_data_->width(), 480);
+  // Go through the data three times
+  for (int iter = 0; iter < 5; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int i = 0; i < 3; ++i) {
+      EXPECT_EQ((iter * 3 + i) % 5, this->blob_top_label_->cpu_data()[i]);
+    }
+  }
+}
+
 TYPED_TEST(ImageDataLayerTest, TestResize) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter param;
@@ -176,4 +200,39 @@ TYPED_TEST(ImageDataLayerTest, TestShuffle) {
   }
 }
 
+TYPED_TEST(ImageDataLayerTest, TestShuffleReadahead) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Reading ahead into the next epoch draws its order early, but must not
+  // change it.
+  vector<Dtype> labels[2];
+  for (int readahead = 0; readahead < 2; ++readahead) {
+    LayerParameter param;
+    ImageDataParameter* image_data_param = param.mutable_image_data_param();
+    image_data_param->set_batch_size(3);
+    image_data_param->set_source(this->filename_.c_str());
+    image_data_param->set_shuffle(true);
+    image_data_param->set_readahead(readahead * 4);
+    Caffe::set_random_seed(this->seed_);
+    ImageDataLayer<Dtype> layer(param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int iter = 0; iter < 5; ++iter) {
+      layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+      labels[readahead].insert(labels[readahead].end(),
+          this->blob_top_label_->cpu_data(),
+          this->blob_top_label_->cpu_data() + 3);
+    }
+  }
+  for (int i = 0; i < labels[0].size(); ++i) {
+    EXPECT_EQ(labels[0][i], labels[1][i]);
+  }
+  // Each epoch is a permutation.
+  for (int epoch = 0; epoch < 3; ++epoch) {
+    map<Dtype, int> values;
+    for (int i = 0; i < 5; ++i) {
+      values[labels[1][epoch * 5 + i]]++;
+    }
+    EXPECT_EQ(5, values.size());
+  }
+}
+
 }  // namespace caffe
@@ -19,5 +19,20 @@ TEST_F(InternalThreadTest, TestStartAndExit) {
   EXPECT_FALSE(thread.is_started());
 }
 
+class LoopingThread : public InternalThread {
+ protected:
+  virtual void InternalThreadEntry() {
+    while (!must_stop()) {}
+  }
+};
+
+TEST_F(InternalThreadTest, TestStartAndStop) {
+  LoopingThread thread;
+  EXPECT_TRUE(thread.StartInternalThread());
+  EXPECT_TRUE(thread.is_started());
+  thread.StopInternalThread();
+  EXPECT_FALSE(thread.is_started());
+}
+
 }  // namespace caffe
 
@@ -210,6 +210,28 @@ TEST_F(IOTest, TestReadImageToCVMatResizedSquare) {
   EXPECT_EQ(cv_img.cols, 256);
 }
 
+TEST_F(IOTest, TestReadImageToCVMatResizedReduced) {
+  string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
+  // Resizing decodes the whole image unless reduced_decode is asked for.
+  cv::Mat full_img;
+  cv::resize(cv::imread(filename, CV_LOAD_IMAGE_COLOR), full_img,
+      cv::Size(100, 100));
+  cv::Mat cv_img = ReadImageToCVMat(filename, 100, 100, true);
+  ASSERT_EQ(cv_img.type(), full_img.type());
+  for (int h = 0; h < 100; ++h) {
+    for (int w = 0; w < 100; ++w) {
+      for (int c = 0; c < 3; ++c) {
+        EXPECT_EQ(full_img.at<cv::Vec3b>(h, w)[c],
+            cv_img.at<cv::Vec3b>(h, w)[c]);
+      }
+    }
+  }
+  cv_img = ReadImageToCVMat(filename, 100, 100, true, true);
+  EXPECT_EQ(cv_img.channels(), 3);
+  EXPECT_EQ(cv_img.rows, 100);
+  EXPECT_EQ(cv_img.cols, 100);
+}
+
 TEST_F(IOTest, TestReadImageToCVMatGray) {
   string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
   const bool is_color = false;
@@ -319,6 +341,30 @@ TEST_F(IOTest, TestDecodeDatumToCVMat) {
   EXPECT_EQ(cv_img.cols, 480);
 }
 
+TEST_F(IOTest, TestDecodeDatumToCVMatReduced) {
+  string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
+  Datum datum;
+  EXPECT_TRUE(ReadFileToDatum(filename, &datum));
+  // 360 x 480 only halves to still cover 100 x 100.
+  cv::Mat cv_img = DecodeDatumToCVMat(datum, true, 100, 100);
+  EXPECT_EQ(cv_img.channels(), 3);
+  EXPECT_EQ(cv_img.rows, 180);
+  EXPECT_EQ(cv_img.cols, 240);
+  cv_img = DecodeDatumToCVMat(datum, false, 40, 40);
+  EXPECT_EQ(cv_img.channels(), 1);
+  EXPECT_EQ(cv_img.rows, 45);
+  EXPECT_EQ(cv_img.cols, 60);
+  // Both sides cover the larger one asked for, as the EXIF orientation may
+  // swap them.
+  cv_img = DecodeDatumToCVMat(datum, true, 80, 100);
+  EXPECT_EQ(cv_img.rows, 180);
+  EXPECT_EQ(cv_img.cols, 240);
+  // Too large to reduce at all.
+  cv_img = DecodeDatumToCVMat(datum, true, 200, 100);
+  EXPECT_EQ(cv_img.rows, 360);
+  EXPECT_EQ(cv_img.cols, 480);
+}
+
 TEST_F(IOTest, TestDecodeDatumToCVMatContent) {
   string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
   Datum datum;
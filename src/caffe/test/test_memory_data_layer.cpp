@@ -3,6 +3,8 @@
 #include <string>
 #include <vector>
 
+#include "boost/thread.hpp"
+
 #include "caffe/data_layers.hpp"
 #include "caffe/filler.hpp"
 
@@ -293,4 +295,146 @@ TYPED_TEST(MemoryDataLayerTest, TestSetBatchSize) {
   }
 }
 
+// Streams batches through a ring on the same thread as Forward, a batch at
+// a time.
+TYPED_TEST(MemoryDataLayerTest, TestRingForward) {
+  typedef typename TypeParam::Dtype Dtype;
+
+  LayerParameter layer_param;
+  MemoryDataParameter* md_param = layer_param.mutable_memory_data_param();
+  md_param->set_batch_size(this->batch_size_);
+  md_param->set_channels(this->channels_);
+  md_param->set_height(this->height_);
+  md_param->set_width(this->width_);
+  md_param->set_ring_size(2);
+  MemoryDataLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int i = 0; i < this->batches_ * 2; ++i) {
+    int batch_num = i % this->batches_;
+    layer.AddBatch(this->data_->cpu_data() +
+        this->data_->offset(this->batch_size_ * batch_num),
+        this->labels_->cpu_data() + this->batch_size_ * batch_num);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int j = 0; j < this->data_blob_->count(); ++j) {
+      EXPECT_EQ(this->data_blob_->cpu_data()[j],
+          this->data_->cpu_data()[
+              this->data_->offset(1) * this->batch_size_ * batch_num + j]);
+    }
+    for (int j = 0; j < this->label_blob_->count(); ++j) {
+      EXPECT_EQ(this->label_blob_->cpu_data()[j],
+          this->labels_->cpu_data()[this->batch_size_ * batch_num + j]);
+    }
+  }
+}
+
+template <typename Dtype>
+static void AddDatumVectorToRing(MemoryDataLayer<Dtype>* layer,
+    const vector<Datum>* datum_vector) {
+  layer->AddDatumVector(*datum_vector);
+}
+
+// Adds more batches than the ring holds from a producer thread, which waits
+// for Forward to free them.
+TYPED_TEST(MemoryDataLayerTest, TestRingProducerThread) {
+  typedef typename TypeParam::Dtype Dtype;
+
+  LayerParameter param;
+  MemoryDataParameter* memory_data_param = param.mutable_memory_data_param();
+  memory_data_param->set_batch_size(this->batch_size_);
+  memory_data_param->set_channels(this->channels_);
+  memory_data_param->set_height(this->height_);
+  memory_data_param->set_width(this->width_);
+  memory_data_param->set_ring_size(3);
+  MemoryDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  const int num = this->batch_size_ * this->batches_;
+  vector<Datum> datum_vector(num);
+  const size_t count = this->channels_ * this->height_ * this->width_;
+  size_t pixel_index = 0;
+  for (int i = 0; i < num; ++i) {
+    datum_vector[i].set_channels(this->channels_);
+    datum_vector[i].set_height(this->height_);
+    datum_vector[i].set_width(this->width_);
+    datum_vector[i].set_label(i);
+    vector<char> pixels(count);
+    for (int j = 0; j < count; ++j) {
+      pixels[j] = pixel_index++ % 256;
+    }
+    datum_vector[i].set_data(&(pixels[0]), count);
+  }
+  boost::thread producer(&AddDatumVectorToRing<Dtype>, &layer,
+      &datum_vector);
+  for (int iter = 0; iter < this->batches_; ++iter) {
+    int offset = this->batch_size_ * iter;
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    const Dtype* data = this->data_blob_->cpu_data();
+    for (int i = 0; i < this->batch_size_; ++i) {
+      const string& data_string = datum_vector[offset + i].data();
+      EXPECT_EQ(offset + i, this->label_blob_->cpu_data()[i]);
+      for (int j = 0; j < count; ++j) {
+        EXPECT_EQ(static_cast<Dtype>(static_cast<uint8_t>(data_string[j])),
+                  data[i * count + j]);
+      }
+    }
+  }
+  producer.join();
+}
+
+// Adds the same items from two producer threads at once, whose batches are
+// interleaved in any order but each transformed whole.
+TYPED_TEST(MemoryDataLayerTest, TestRingProducerThreads) {
+  typedef typename TypeParam::Dtype Dtype;
+
+  LayerParameter param;
+  MemoryDataParameter* memory_data_param = param.mutable_memory_data_param();
+  memory_data_param->set_batch_size(this->batch_size_);
+  memory_data_param->set_channels(this->channels_);
+  memory_data_param->set_height(this->height_);
+  memory_data_param->set_width(this->width_);
+  memory_data_param->set_ring_size(3);
+  param.mutable_transform_param()->set_scale(0.5);
+  MemoryDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  const int num = this->batch_size_ * this->batches_;
+  vector<Datum> datum_vector(num);
+  const size_t count = this->channels_ * this->height_ * this->width_;
+  size_t pixel_index = 0;
+  for (int i = 0; i < num; ++i) {
+    datum_vector[i].set_channels(this->channels_);
+    datum_vector[i].set_height(this->height_);
+    datum_vector[i].set_width(this->width_);
+    datum_vector[i].set_label(i);
+    vector<char> pixels(count);
+    for (int j = 0; j < count; ++j) {
+      pixels[j] = pixel_index++ % 256;
+    }
+    datum_vector[i].set_data(&(pixels[0]), count);
+  }
+  boost::thread producer0(&AddDatumVectorToRing<Dtype>, &layer,
+      &datum_vector);
+  boost::thread producer1(&AddDatumVectorToRing<Dtype>, &layer,
+      &datum_vector);
+  vector<int> times_read(this->batches_, 0);
+  for (int iter = 0; iter < this->batches_ * 2; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    const Dtype* data = this->data_blob_->cpu_data();
+    const int offset = this->label_blob_->cpu_data()[0];
+    ASSERT_EQ(0, offset % this->batch_size_);
+    ++times_read[offset / this->batch_size_];
+    for (int i = 0; i < this->batch_size_; ++i) {
+      const string& data_string = datum_vector[offset + i].data();
+      EXPECT_EQ(offset + i, this->label_blob_->cpu_data()[i]);
+      for (int j = 0; j < count; ++j) {
+        EXPECT_EQ(static_cast<Dtype>(static_cast<uint8_t>(data_string[j]))
+                  * Dtype(0.5), data[i * count + j]);
+      }
+    }
+  }
+  producer0.join();
+  producer1.join();
+  for (int i = 0; i < this->batches_; ++i) {
+    EXPECT_EQ(2, times_read[i]);
+  }
+}
+
 }  // namespace caffe
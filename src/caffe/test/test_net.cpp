@@ -613,6 +613,94 @@ class NetTest : public MultiDeviceTest<TypeParam> {
     InitNetFromProtoString(proto);
   }
 
+  virtual void InitPlannedNet(const string& options,
+                              const string& extra_layers = "") {
+    const string& proto =
+        "name: 'PlannedNetwork' "
+        "input: 'data' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 10 "
+        "input_dim: 10 "
+        "layer { "
+        "  name: 'conv1' "
+        "  type: 'Convolution' "
+        "  bottom: 'data' "
+        "  top: 'conv1' "
+        "  convolution_param { "
+        "    num_output: 5 "
+        "    kernel_size: 3 "
+        "    weight_filler { "
+        "      type: 'gaussian' "
+        "      std: 0.1 "
+        "    } "
+        "  } "
+        "} "
+        "layer { "
+        "  name: 'relu1' "
+        "  type: 'ReLU' "
+        "  bottom: 'conv1' "
+        "  top: 'conv1' "
+        "} "
+        "layer { "
+        "  name: 'pool1' "
+        "  type: 'Pooling' "
+        "  bottom: 'conv1' "
+        "  top: 'pool1' "
+        "  pooling_param { "
+        "    pool: MAX "
+        "    kernel_size: 2 "
+        "    stride: 2 "
+        "  } "
+        "} "
+        "layer { "
+        "  name: 'norm1' "
+        "  type: 'LRN' "
+        "  bottom: 'pool1' "
+        "  top: 'norm1' "
+        "} "
+        "layer { "
+        "  name: 'sum1' "
+        "  type: 'Eltwise' "
+        "  bottom: 'pool1' "
+        "  bottom: 'norm1' "
+        "  top: 'sum1' "
+        "} "
+        "layer { "
+        "  name: 'flatten1' "
+        "  type: 'Flatten' "
+        "  bottom: 'sum1' "
+        "  top: 'flatten1' "
+        "} "
+        "layer { "
+        "  name: 'ip1' "
+        "  type: 'InnerProduct' "
+        "  bottom: 'flatten1' "
+        "  top: 'ip1' "
+        "  inner_product_param { "
+        "    num_output: 10 "
+        "    weight_filler { "
+        "      type: 'gaussian' "
+        "      std: 0.1 "
+        "    } "
+        "  } "
+        "} "
+        "layer { "
+        "  name: 'ip2' "
+        "  type: 'InnerProduct' "
+        "  bottom: 'ip1' "
+        "  top: 'ip2' "
+        "  inner_product_param { "
+        "    num_output: 4 "
+        "    weight_filler { "
+        "      type: 'gaussian' "
+        "      std: 0.1 "
+        "    } "
+        "  } "
+        "} ";
+    InitNetFromProtoString(options + proto + extra_layers);
+  }
+
   int seed_;
   shared_ptr<Net<Dtype> > net_;
 };
@@ -2224,4 +2312,158 @@ TYPED_TEST(NetTest, TestReshape) {
   }
 }
 
+TYPED_TEST(NetTest, TestPlanMemory) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> input(2, 3, 10, 10);
+  filler.Fill(&input);
+  vector<Blob<Dtype>*> bottom(1, &input);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitPlannedNet("state: { phase: TEST } ");
+  this->net_->Forward(bottom);
+  Blob<Dtype> expected;
+  expected.CopyFrom(*this->net_->output_blobs()[0], false, true);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitPlannedNet("state: { phase: TEST } plan_memory: true ");
+  const Net<Dtype>& net = *this->net_;
+  // conv1 is dead once pool1 is computed, so norm1 can take its memory,
+  // but not that of pool1, which sum1 still reads through its split.
+  EXPECT_EQ(net.blob_by_name("conv1")->data(),
+            net.blob_by_name("norm1")->data());
+  EXPECT_NE(net.blob_by_name("pool1")->data(),
+            net.blob_by_name("norm1")->data());
+  EXPECT_EQ(net.blob_by_name("pool1")->data(),
+            net.blob_by_name("pool1_pool1_0_split_1")->data());
+  EXPECT_NE(net.blob_by_name("sum1")->data(), net.blob_by_name("ip1")->data());
+  // The input and output keep their memory.
+  for (int i = 0; i < net.blobs().size(); ++i) {
+    if (net.blob_names()[i] != "data") {
+      EXPECT_NE(net.blobs()[i]->data(), net.blob_by_name("data")->data());
+    }
+    if (net.blob_names()[i] != "ip2") {
+      EXPECT_NE(net.blobs()[i]->data(), net.blob_by_name("ip2")->data());
+    }
+  }
+  // Run twice, as the first pass leaves the memory of dead blobs dirty.
+  for (int pass = 0; pass < 2; ++pass) {
+    const Blob<Dtype>& output = *this->net_->Forward(bottom)[0];
+    ASSERT_EQ(output.count(), expected.count());
+    for (int i = 0; i < output.count(); ++i) {
+      EXPECT_EQ(output.cpu_data()[i], expected.cpu_data()[i]);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestPlanMemoryKeepBlob) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> input(2, 3, 10, 10);
+  filler.Fill(&input);
+  vector<Blob<Dtype>*> bottom(1, &input);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitPlannedNet("state: { phase: TEST } ");
+  this->net_->Forward(bottom);
+  Blob<Dtype> expected;
+  expected.CopyFrom(*this->net_->blob_by_name("conv1"), false, true);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitPlannedNet(
+      "state: { phase: TEST } plan_memory: true keep_blob: 'conv1' ");
+  const Net<Dtype>& net = *this->net_;
+  const shared_ptr<Blob<Dtype> > conv1 = net.blob_by_name("conv1");
+  for (int i = 0; i < net.blobs().size(); ++i) {
+    if (net.blob_names()[i] != "conv1") {
+      EXPECT_NE(net.blobs()[i]->data(), conv1->data());
+    }
+  }
+  this->net_->Forward(bottom);
+  ASSERT_EQ(conv1->count(), expected.count());
+  for (int i = 0; i < conv1->count(); ++i) {
+    EXPECT_EQ(conv1->cpu_data()[i], expected.cpu_data()[i]);
+  }
+}
+
+TYPED_TEST(NetTest, TestPlanDiffMemory) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> target(2, 4, 1, 1);
+  Blob<Dtype> input(2, 3, 10, 10);
+  filler.Fill(&target);
+  filler.Fill(&input);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&target);
+  bottom.push_back(&input);
+  const string options =
+      "state: { phase: TRAIN } "
+      "force_backward: true "
+      "input: 'target' "
+      "input_dim: 2 "
+      "input_dim: 4 "
+      "input_dim: 1 "
+      "input_dim: 1 ";
+  const string loss_layer =
+      "layer { "
+      "  name: 'loss' "
+      "  type: 'EuclideanLoss' "
+      "  bottom: 'ip2' "
+      "  bottom: 'target' "
+      "  top: 'loss' "
+      "} ";
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitPlannedNet(options, loss_layer);
+  this->net_->ForwardBackward(bottom);
+  vector<shared_ptr<Blob<Dtype> > > expected_params;
+  const bool kCopyDiff = true;
+  this->CopyNetParams(kCopyDiff, &expected_params);
+  Blob<Dtype> expected_input_diff;
+  expected_input_diff.CopyFrom(*this->net_->blob_by_name("data"), kCopyDiff,
+      true);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitPlannedNet(options + "plan_memory: true verify_memory_plan: true ",
+      loss_layer);
+  const Net<Dtype>& net = *this->net_;
+  // The diff of ip2 is dead once ip1 has its own, so sum1 and flatten1,
+  // which share theirs, can take its memory, but ip1 cannot.
+  EXPECT_EQ(net.blob_by_name("ip2")->diff(),
+            net.blob_by_name("flatten1")->diff());
+  EXPECT_EQ(net.blob_by_name("flatten1")->diff(),
+            net.blob_by_name("sum1")->diff());
+  EXPECT_NE(net.blob_by_name("ip1")->diff(), net.blob_by_name("ip2")->diff());
+  // The loss weight in the diff of the loss, and the input, keep theirs.
+  for (int i = 0; i < net.blobs().size(); ++i) {
+    if (net.blob_names()[i] != "loss") {
+      EXPECT_NE(net.blobs()[i]->diff(), net.blob_by_name("loss")->diff());
+    }
+    if (net.blob_names()[i] != "data") {
+      EXPECT_NE(net.blobs()[i]->diff(), net.blob_by_name("data")->diff());
+    }
+  }
+  // Run twice, as the first pass leaves the memory of dead diffs dirty.
+  for (int pass = 0; pass < 2; ++pass) {
+    this->net_->ForwardBackward(bottom);
+    const vector<shared_ptr<Blob<Dtype> > >& params = net.params();
+    ASSERT_EQ(params.size(), expected_params.size());
+    for (int i = 0; i < params.size(); ++i) {
+      for (int j = 0; j < params[i]->count(); ++j) {
+        EXPECT_EQ(params[i]->cpu_diff()[j], expected_params[i]->cpu_diff()[j]);
+      }
+    }
+    const Blob<Dtype>& input_diff = *net.blob_by_name("data");
+    for (int i = 0; i < input_diff.count(); ++i) {
+      EXPECT_EQ(input_diff.cpu_diff()[i], expected_input_diff.cpu_diff()[i]);
+    }
+  }
+}
+
 }  // namespace caffe
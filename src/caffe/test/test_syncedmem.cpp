@@ -68,8 +68,37 @@ TEST_F(SyncedMemoryTest, TestCPUWrite) {
   }
 }
 
+TEST_F(SyncedMemoryTest, TestWriteOnlyCPU) {
+  SyncedMemory mem(10);
+  void* cpu_data = mem.write_only_cpu_data();
+  EXPECT_EQ(mem.head(), SyncedMemory::HEAD_AT_CPU);
+  caffe_memset(mem.size(), 1, cpu_data);
+  // The same memory is handed back, keeping its contents.
+  EXPECT_EQ(mem.write_only_cpu_data(), cpu_data);
+  EXPECT_EQ(mem.head(), SyncedMemory::HEAD_AT_CPU);
+  for (int i = 0; i < mem.size(); ++i) {
+    EXPECT_EQ((static_cast<const char*>(mem.cpu_data()))[i], 1);
+  }
+}
+
 #ifndef CPU_ONLY  // GPU test
 
+TEST_F(SyncedMemoryTest, TestWriteOnlyCPUAfterGPUWrite) {
+  SyncedMemory mem(10);
+  caffe_gpu_memset(mem.size(), 1, mem.mutable_gpu_data());
+  void* cpu_data = mem.write_only_cpu_data();
+  EXPECT_EQ(mem.head(), SyncedMemory::HEAD_AT_CPU);
+  caffe_memset(mem.size(), 2, cpu_data);
+  // The new contents reach the GPU, not those written there before.
+  const void* gpu_data = mem.gpu_data();
+  EXPECT_EQ(mem.head(), SyncedMemory::SYNCED);
+  char recovered_value[10];
+  caffe_gpu_memcpy(10, gpu_data, recovered_value);
+  for (int i = 0; i < mem.size(); ++i) {
+    EXPECT_EQ(recovered_value[i], 2);
+  }
+}
+
 TEST_F(SyncedMemoryTest, TestGPURead) {
   SyncedMemory mem(10);
   void* cpu_data = mem.mutable_cpu_data();
@@ -0,0 +1,46 @@
+#include <boost/bind.hpp>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/thread_pool.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class ThreadPoolTest : public ::testing::Test {
+ public:
+  void Fill(int worker_id, int num_workers) {
+    for (int i = worker_id; i < values_.size(); i += num_workers) {
+      values_[i] = i;
+    }
+  }
+
+  vector<int> values_;
+};
+
+TEST_F(ThreadPoolTest, TestSingleWorker) {
+  ThreadPool pool(1);
+  EXPECT_EQ(pool.size(), 1);
+  values_.resize(10, -1);
+  pool.Run(boost::bind(&ThreadPoolTest::Fill, this, _1, pool.size()));
+  for (int i = 0; i < values_.size(); ++i) {
+    EXPECT_EQ(values_[i], i);
+  }
+}
+
+TEST_F(ThreadPoolTest, TestDisjointSlots) {
+  ThreadPool pool(4);
+  EXPECT_EQ(pool.size(), 4);
+  for (int iter = 0; iter < 10; ++iter) {
+    values_.assign(103, -1);
+    pool.Run(boost::bind(&ThreadPoolTest::Fill, this, _1, pool.size()));
+    for (int i = 0; i < values_.size(); ++i) {
+      EXPECT_EQ(values_[i], i);
+    }
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,140 @@
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <fstream>  // NOLINT(readability/streams)
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/data_layers.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class WindowDataLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  WindowDataLayerTest()
+      : seed_(1701),
+        blob_top_data_(new Blob<Dtype>()),
+        blob_top_label_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    blob_top_vec_.push_back(blob_top_data_);
+    blob_top_vec_.push_back(blob_top_label_);
+    // Write 3 images of distinct sizes and pixels, each with a foreground
+    // window of its own class and a background window.
+    string dir;
+    MakeTempDir(&dir);
+    MakeTempFilename(&filename_);
+    std::ofstream outfile(filename_.c_str(), std::ofstream::out);
+    LOG(INFO) << "Using temporary file " << filename_;
+    for (int i = 0; i < 3; ++i) {
+      const int height = 20 + 5 * i;
+      const int width = 30 - 5 * i;
+      cv::Mat image(height, width, CV_8UC3);
+      for (int h = 0; h < height; ++h) {
+        uchar* pixel = image.ptr<uchar>(h);
+        for (int w = 0; w < width; ++w) {
+          *pixel++ = 10 * i + h;
+          *pixel++ = 7 * w;
+          *pixel++ = (h * w) % 256;
+        }
+      }
+      std::ostringstream path;
+      path << dir << "/" << i << ".png";
+      CHECK(cv::imwrite(path.str(), image));
+      outfile << "# " << i << "\n" << path.str() << "\n3\n" << height
+          << "\n" << width << "\n2\n"
+          << i + 1 << " 0.9 2 3 " << width - 4 << " " << height - 2 << "\n"
+          << "0 0.1 0 0 " << width / 2 << " " << height / 2 << "\n";
+    }
+    outfile.close();
+  }
+
+  virtual ~WindowDataLayerTest() {
+    delete blob_top_data_;
+    delete blob_top_label_;
+  }
+
+  // Reads a few batches with the same sampling seed, and appends their
+  // pixels and labels.
+  void Read(int decode_threads, uint64_t cache_bytes, vector<Dtype>* data,
+      vector<Dtype>* labels) {
+    LayerParameter param;
+    WindowDataParameter* window_param = param.mutable_window_data_param();
+    window_param->set_source(filename_.c_str());
+    window_param->set_batch_size(8);
+    window_param->set_fg_fraction(0.5);
+    window_param->set_context_pad(2);
+    window_param->set_decode_threads(decode_threads);
+    window_param->set_cache_bytes(cache_bytes);
+    TransformationParameter* transform_param =
+        param.mutable_transform_param();
+    transform_param->set_crop_size(12);
+    transform_param->set_mirror(true);
+    Caffe::set_random_seed(seed_);
+    WindowDataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    EXPECT_EQ(blob_top_data_->num(), 8);
+    EXPECT_EQ(blob_top_data_->channels(), 3);
+    EXPECT_EQ(blob_top_data_->height(), 12);
+    EXPECT_EQ(blob_top_data_->width(), 12);
+    for (int iter = 0; iter < 5; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      data->insert(data->end(), blob_top_data_->cpu_data(),
+          blob_top_data_->cpu_data() + blob_top_data_->count());
+      labels->insert(labels->end(), blob_top_label_->cpu_data(),
+          blob_top_label_->cpu_data() + blob_top_label_->count());
+    }
+  }
+
+  void TestReadMatches(int decode_threads, uint64_t cache_bytes) {
+    vector<Dtype> expected_data, expected_labels;
+    Read(1, 0, &expected_data, &expected_labels);
+    vector<Dtype> data, labels;
+    Read(decode_threads, cache_bytes, &data, &labels);
+    ASSERT_EQ(expected_labels.size(), labels.size());
+    for (int i = 0; i < labels.size(); ++i) {
+      EXPECT_EQ(expected_labels[i], labels[i]);
+      // Half of each batch is background.
+      EXPECT_EQ(i % 8 < 4, labels[i] == 0) << "debug: i " << i;
+    }
+    ASSERT_EQ(expected_data.size(), data.size());
+    for (int i = 0; i < data.size(); ++i) {
+      EXPECT_EQ(expected_data[i], data[i]) << "debug: i " << i;
+    }
+  }
+
+  int seed_;
+  string filename_;
+  Blob<Dtype>* const blob_top_data_;
+  Blob<Dtype>* const blob_top_label_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(WindowDataLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(WindowDataLayerTest, TestReadThreads) {
+  this->TestReadMatches(3, 0);
+}
+
+TYPED_TEST(WindowDataLayerTest, TestReadCache) {
+  this->TestReadMatches(1, 1 << 20);
+}
+
+TYPED_TEST(WindowDataLayerTest, TestReadThreadsCache) {
+  // A budget for about 2 of the 3 images, so that some are evicted.
+  this->TestReadMatches(2, 4000);
+}
+
+}  // namespace caffe
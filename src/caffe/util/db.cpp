@@ -1,12 +1,142 @@
 #include "caffe/util/db.hpp"
 
+#include <boost/thread.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
 #include <string>
+#include <vector>
+
+#include "caffe/util/rng.hpp"
 
 namespace caffe { namespace db {
 
 const size_t LMDB_MAP_SIZE = 1099511627776;  // 1 TB
 
+struct LessThanKeyAt {
+  explicit LessThanKeyAt(const vector<string>* keys) : keys_(keys) { }
+  bool operator()(int a, int b) const { return (*keys_)[a] < (*keys_)[b]; }
+  bool operator()(int a, const string& key) const {
+    return (*keys_)[a] < key;
+  }
+  const vector<string>* keys_;
+};
+
+// Returns the indices of keys in key order.
+static vector<int> SortKeys(const vector<string>& keys) {
+  vector<int> sorted(keys.size());
+  for (int i = 0; i < keys.size(); ++i) {
+    sorted[i] = i;
+  }
+  std::sort(sorted.begin(), sorted.end(), LessThanKeyAt(&keys));
+  return sorted;
+}
+
+// Returns the index of key in keys, or keys.size() if it is not there.
+static size_t FindKey(const vector<string>& keys,
+    const vector<int>& sorted, const string& key) {
+  vector<int>::const_iterator it = std::lower_bound(sorted.begin(),
+      sorted.end(), key, LessThanKeyAt(&keys));
+  return it != sorted.end() && keys[*it] == key ? *it : keys.size();
+}
+
+ShardCursor::ShardCursor(Cursor* cursor, const vector<string>& keys)
+  : cursor_(cursor), keys_(keys), sorted_(SortKeys(keys_)), pos_(0) {
+  SeekToFirst();
+}
+
+void ShardCursor::SeekToFirst() {
+  pos_ = 0;
+  if (!keys_.empty()) {
+    CHECK(cursor_->Seek(keys_[0])) << "Key " << keys_[0] << " not found";
+  }
+}
+
+void ShardCursor::Next() {
+  ++pos_;
+  if (pos_ < keys_.size()) {
+    cursor_->Next();
+    DCHECK(cursor_->valid() && cursor_->key() == keys_[pos_])
+        << "Keys are not a run of the cursor at " << keys_[pos_];
+  }
+}
+
+bool ShardCursor::Seek(const string& key) {
+  pos_ = FindKey(keys_, sorted_, key);
+  return pos_ < keys_.size() && cursor_->Seek(key);
+}
+
+ShuffleCursor::ShuffleCursor(Cursor* cursor, const vector<string>& keys,
+    int block_size, unsigned int seed)
+  : cursor_(cursor), keys_(keys), block_size_(block_size),
+    rng_(new Caffe::RNG(seed)), sorted_(SortKeys(keys_)), pos_(0) {
+  CHECK_GE(block_size_, 0);
+  SeekToFirst();
+}
+
+void ShuffleCursor::SeekToFirst() {
+  Shuffle();
+  position_.resize(order_.size());
+  for (int i = 0; i < order_.size(); ++i) {
+    position_[order_[i]] = i;
+  }
+  pos_ = 0;
+  SeekCurrent();
+}
+
+void ShuffleCursor::Next() {
+  ++pos_;
+  SeekCurrent();
+}
+
+bool ShuffleCursor::Seek(const string& key) {
+  const size_t index = FindKey(keys_, sorted_, key);
+  pos_ = index < keys_.size() ? position_[index] : order_.size();
+  return pos_ < order_.size() && cursor_->Seek(key);
+}
+
+void ShuffleCursor::Shuffle() {
+  caffe::rng_t* rng = static_cast<caffe::rng_t*>(rng_->generator());
+  const int num_keys = keys_.size();
+  order_.resize(num_keys);
+  if (block_size_ == 0 || block_size_ >= num_keys) {
+    for (int i = 0; i < num_keys; ++i) {
+      order_[i] = i;
+    }
+    shuffle(order_.begin(), order_.end(), rng);
+    return;
+  }
+  const int num_blocks = (num_keys + block_size_ - 1) / block_size_;
+  vector<int> blocks(num_blocks);
+  for (int i = 0; i < num_blocks; ++i) {
+    blocks[i] = i;
+  }
+  shuffle(blocks.begin(), blocks.end(), rng);
+  vector<int>::iterator block_begin = order_.begin();
+  for (int i = 0; i < num_blocks; ++i) {
+    const int begin = blocks[i] * block_size_;
+    const int end = std::min(begin + block_size_, num_keys);
+    for (int j = begin; j < end; ++j) {
+      *(block_begin + j - begin) = j;
+    }
+    shuffle(block_begin, block_begin + end - begin, rng);
+    block_begin += end - begin;
+  }
+}
+
+void ShuffleCursor::SeekCurrent() {
+  if (pos_ < order_.size()) {
+    const string& key = keys_[order_[pos_]];
+    CHECK(cursor_->Seek(key)) << "Key " << key << " not found";
+  }
+}
+
 void LevelDB::Open(const string& source, Mode mode) {
   leveldb::Options options;
   options.block_size = 65536;
@@ -47,7 +177,7 @@ LMDBTransaction* LMDB::NewTransaction() {
   MDB_txn* mdb_txn;
   MDB_CHECK(mdb_txn_begin(mdb_env_, NULL, 0, &mdb_txn));
   MDB_CHECK(mdb_dbi_open(mdb_txn, NULL, 0, &mdb_dbi_));
-  return new LMDBTransaction(&mdb_dbi_, mdb_txn);
+  return new LMDBTransaction(&mdb_dbi_, mdb_txn, put_flags_);
 }
 
 void LMDBTransaction::Put(const string& key, const string& value) {
@@ -56,7 +186,289 @@ void LMDBTransaction::Put(const string& key, const string& value) {
   mdb_key.mv_size = key.size();
   mdb_value.mv_data = const_cast<char*>(value.data());
   mdb_value.mv_size = value.size();
-  MDB_CHECK(mdb_put(mdb_txn_, *mdb_dbi_, &mdb_key, &mdb_value, 0));
+  MDB_CHECK(mdb_put(mdb_txn_, *mdb_dbi_, &mdb_key, &mdb_value, put_flags_));
+}
+
+// Records are read ahead this many bytes at a time.
+const uint64_t RECORD_READAHEAD = 16 << 20;
+
+void RecordCursor::SeekToFirst() {
+  shard_ = 0;
+  record_ = 0;
+  readahead_end_ = 0;
+  Settle(true);
+}
+
+void RecordCursor::Next() {
+  ++record_;
+  Settle(true);
+}
+
+// Points key at the key bytes of a record, without touching its value.
+static void RecordKey(const RecordShard& shard, size_t record,
+    const char** key, uint32_t* key_size) {
+  const char* data = shard.data + shard.offsets[record];
+  memcpy(key_size, data, sizeof(*key_size));  // NOLINT(caffe/alt_fn)
+  *key = data + 2 * sizeof(uint32_t);
+}
+
+// Orders byte strings like std::string does.
+static int CompareKeys(const char* a, size_t a_size, const char* b,
+    size_t b_size) {
+  const int cmp = memcmp(a, b, std::min(a_size, b_size));
+  if (cmp != 0) {
+    return cmp;
+  }
+  return a_size < b_size ? -1 : (a_size > b_size ? 1 : 0);
+}
+
+class RecordKeyIndex {
+ public:
+  explicit RecordKeyIndex(const vector<RecordShard>* shards)
+    : shards_(shards), built_(false) { }
+
+  // Finds the shard and record of key, if it exists.
+  bool Find(const string& key, size_t* shard, size_t* record) {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (!built_) {
+        Build();
+        built_ = true;
+      }
+    }
+    vector<Position>::const_iterator it = std::lower_bound(
+        positions_.begin(), positions_.end(), key, LessThanKey(this));
+    if (it == positions_.end() || CompareTo(*it, key) != 0) {
+      return false;
+    }
+    *shard = it->shard;
+    *record = it->record;
+    return true;
+  }
+
+ private:
+  struct Position {
+    uint32_t shard;
+    uint64_t record;
+  };
+
+  struct LessThanKey {
+    explicit LessThanKey(const RecordKeyIndex* index) : index_(index) { }
+    bool operator()(const Position& a, const Position& b) const {
+      const char* b_key;
+      uint32_t b_size;
+      RecordKey((*index_->shards_)[b.shard], b.record, &b_key, &b_size);
+      return index_->CompareTo(a, b_key, b_size) < 0;
+    }
+    bool operator()(const Position& a, const string& key) const {
+      return index_->CompareTo(a, key) < 0;
+    }
+    const RecordKeyIndex* index_;
+  };
+
+  int CompareTo(const Position& a, const char* key, size_t key_size) const {
+    const char* a_key;
+    uint32_t a_size;
+    RecordKey((*shards_)[a.shard], a.record, &a_key, &a_size);
+    return CompareKeys(a_key, a_size, key, key_size);
+  }
+  int CompareTo(const Position& a, const string& key) const {
+    return CompareTo(a, key.data(), key.size());
+  }
+
+  // Sorts the record offsets of all shards by key, which only touches the
+  // record headers and keys. Seeking by key needs every key to be unique,
+  // also across shards written by separate processes.
+  void Build() {
+    for (size_t i = 0; i < shards_->size(); ++i) {
+      for (size_t j = 0; j < (*shards_)[i].num_records; ++j) {
+        Position position = { static_cast<uint32_t>(i), j };
+        positions_.push_back(position);
+      }
+    }
+    std::sort(positions_.begin(), positions_.end(), LessThanKey(this));
+    for (size_t i = 1; i < positions_.size(); ++i) {
+      const char* key;
+      uint32_t key_size;
+      RecordKey((*shards_)[positions_[i].shard], positions_[i].record, &key,
+          &key_size);
+      CHECK_NE(CompareTo(positions_[i - 1], key, key_size), 0)
+          << "Duplicate key " << string(key, key_size) << " in shards "
+          << positions_[i - 1].shard << " and " << positions_[i].shard
+          << "; keys must be unique to seek in a record file";
+    }
+  }
+
+  const vector<RecordShard>* shards_;
+  boost::mutex mutex_;
+  bool built_;
+  vector<Position> positions_;
+};
+
+bool RecordCursor::Seek(const string& key) {
+  if (!key_index_->Find(key, &shard_, &record_)) {
+    shard_ = shards_->size();
+    return false;
+  }
+  readahead_end_ = 0;
+  Settle(false);
+  return true;
+}
+
+void RecordCursor::Settle(bool readahead) {
+  while (shard_ < shards_->size() &&
+         record_ >= (*shards_)[shard_].num_records) {
+    ++shard_;
+    record_ = 0;
+    readahead_end_ = 0;
+  }
+  if (!valid()) {
+    return;
+  }
+  const RecordShard& shard = (*shards_)[shard_];
+  const uint64_t offset = shard.offsets[record_];
+  uint32_t sizes[2];
+  CHECK_LE(offset + sizeof(sizes), shard.data_size) << "Corrupt record";
+  memcpy(sizes, shard.data + offset, sizeof(sizes));  // NOLINT(caffe/alt_fn)
+  key_size_ = sizes[0];
+  value_size_ = sizes[1];
+  key_ = shard.data + offset + sizeof(sizes);
+  value_ = key_ + key_size_;
+  CHECK_LE(value_ + value_size_, shard.data + shard.data_size)
+      << "Corrupt record";
+  // When streaming, ask for the next window of the file once the cursor
+  // reaches it.
+  if (readahead && offset >= readahead_end_) {
+    const uint64_t begin = offset - offset % sysconf(_SC_PAGESIZE);
+    const uint64_t end = std::min<uint64_t>(offset + RECORD_READAHEAD,
+        shard.data_size);
+    madvise(const_cast<char*>(shard.data + begin), end - begin,
+        MADV_WILLNEED);
+    readahead_end_ = end;
+  }
+}
+
+static void WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    CHECK_GE(written, 0) << "Failed to write record file: "
+                         << strerror(errno);
+    data += written;
+    size -= written;
+  }
+}
+
+void RecordTransaction::Put(const string& key, const string& value) {
+  offsets_.push_back(data_.size());
+  const uint32_t sizes[2] = { static_cast<uint32_t>(key.size()),
+                              static_cast<uint32_t>(value.size()) };
+  data_.append(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+  data_.append(key);
+  data_.append(value);
+}
+
+void RecordTransaction::Commit() {
+  for (int i = 0; i < offsets_.size(); ++i) {
+    offsets_[i] += *data_end_;
+  }
+  WriteAll(data_fd_, data_.data(), data_.size());
+  WriteAll(index_fd_, reinterpret_cast<const char*>(offsets_.data()),
+      offsets_.size() * sizeof(uint64_t));
+  *data_end_ += data_.size();
+  data_.clear();
+  offsets_.clear();
+}
+
+static string RecordShardName(const string& source, int shard,
+    const char* extension) {
+  ostringstream name;
+  name << source << "/" << std::setw(5) << std::setfill('0') << shard
+       << extension;
+  return name.str();
+}
+
+// Maps a whole file read-only, or returns NULL if it is empty.
+static const char* MapFile(const string& filename, size_t* size) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  CHECK_GE(fd, 0) << "Failed to open " << filename << ": " << strerror(errno);
+  struct stat st;
+  CHECK_EQ(fstat(fd, &st), 0) << "Failed to stat " << filename;
+  *size = st.st_size;
+  void* data = NULL;
+  if (*size > 0) {
+    data = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    CHECK(data != MAP_FAILED) << "Failed to map " << filename << ": "
+                              << strerror(errno);
+    // Cursors may seek anywhere, so only streaming cursors ask for
+    // readahead, one window at a time.
+    madvise(data, *size, MADV_RANDOM);
+  }
+  close(fd);
+  return static_cast<const char*>(data);
+}
+
+void RecordDB::Open(const string& source, Mode mode) {
+  if (mode == NEW) {
+    CHECK_EQ(mkdir(source.c_str(), 0744), 0) << "mkdir " << source << "failed";
+  } else if (mode == WRITE) {
+    CHECK(mkdir(source.c_str(), 0744) == 0 || errno == EEXIST)
+        << "mkdir " << source << "failed";
+  }
+  if (mode == READ) {
+    struct stat st;
+    for (int i = 0; stat(RecordShardName(source, i, ".dat").c_str(), &st) == 0;
+         ++i) {
+      RecordShard shard;
+      size_t index_size;
+      shard.data = MapFile(RecordShardName(source, i, ".dat"),
+          &shard.data_size);
+      shard.offsets = reinterpret_cast<const uint64_t*>(
+          MapFile(RecordShardName(source, i, ".idx"), &index_size));
+      CHECK_EQ(index_size % sizeof(uint64_t), 0) << "Corrupt record index";
+      shard.num_records = index_size / sizeof(uint64_t);
+      shards_.push_back(shard);
+    }
+    CHECK_GT(shards_.size(), 0) << "No record shards in " << source;
+    key_index_.reset(new RecordKeyIndex(&shards_));
+    LOG(INFO) << "Opened record file " << source << " with "
+              << shards_.size() << " shards";
+    return;
+  }
+  // Claim the first free shard; O_EXCL makes this safe between writers.
+  int shard = 0;
+  for (;; ++shard) {
+    data_fd_ = open(RecordShardName(source, shard, ".dat").c_str(),
+        O_WRONLY | O_CREAT | O_EXCL, 0664);
+    if (data_fd_ >= 0) {
+      break;
+    }
+    CHECK_EQ(errno, EEXIST) << "Failed to create record shard in " << source
+                            << ": " << strerror(errno);
+  }
+  index_fd_ = open(RecordShardName(source, shard, ".idx").c_str(),
+      O_WRONLY | O_CREAT | O_TRUNC, 0664);
+  CHECK_GE(index_fd_, 0) << "Failed to create record index in " << source;
+  data_end_ = 0;
+  LOG(INFO) << "Opened record file " << source << " shard " << shard;
+}
+
+void RecordDB::Close() {
+  for (int i = 0; i < shards_.size(); ++i) {
+    if (shards_[i].data != NULL) {
+      munmap(const_cast<char*>(shards_[i].data), shards_[i].data_size);
+    }
+    if (shards_[i].offsets != NULL) {
+      munmap(const_cast<uint64_t*>(shards_[i].offsets),
+          shards_[i].num_records * sizeof(uint64_t));
+    }
+  }
+  shards_.clear();
+  key_index_.reset();
+  if (data_fd_ >= 0) {
+    close(data_fd_);
+    close(index_fd_);
+    data_fd_ = index_fd_ = -1;
+  }
 }
 
 DB* GetDB(DataParameter::DB backend) {
@@ -65,6 +477,8 @@ DB* GetDB(DataParameter::DB backend) {
     return new LevelDB();
   case DataParameter_DB_LMDB:
     return new LMDB();
+  case DataParameter_DB_RECORDFILE:
+    return new RecordDB();
   default:
     LOG(FATAL) << "Unknown database backend";
   }
@@ -75,6 +489,8 @@ DB* GetDB(const string& backend) {
     return new LevelDB();
   } else if (backend == "lmdb") {
     return new LMDB();
+  } else if (backend == "recordfile") {
+    return new RecordDB();
   } else {
     LOG(FATAL) << "Unknown database backend";
   }
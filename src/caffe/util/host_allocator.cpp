@@ -0,0 +1,166 @@
+#include <boost/thread.hpp>
+#include <sys/mman.h>
+
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+#include "caffe/util/host_allocator.hpp"
+
+namespace caffe {
+
+// Smallest size class.
+static const size_t kMinClassSize = 64;
+// Default bound on the bytes kept on the free lists.
+static const size_t kDefaultCacheLimit = size_t(1) << 30;
+// From 8MB on, size classes are whole numbers of huge pages.
+static const size_t kDefaultHugePageThreshold = 8 << 20;
+
+const size_t HostAllocator::kAlignment;
+const size_t HostAllocator::kHugePageSize;
+
+class HostAllocator::sync {
+ public:
+  sync()
+      : cache_limit_(kDefaultCacheLimit),
+        huge_page_threshold_(kDefaultHugePageThreshold) { }
+
+  mutable boost::mutex mutex_;
+  // Free buffers by size class.
+  map<size_t, vector<void*> > free_lists_;
+  Stats stats_;
+  size_t cache_limit_;
+  size_t huge_page_threshold_;
+};
+
+HostAllocator& HostAllocator::Get() {
+  // Never destroyed, as blobs of static objects may still be freed after
+  // the end of main.
+  static HostAllocator* allocator = new HostAllocator();
+  return *allocator;
+}
+
+HostAllocator::HostAllocator()
+    : sync_(new sync()) {
+}
+
+size_t HostAllocator::ClassSize(size_t size) {
+  if (size <= kMinClassSize) {
+    return kMinClassSize;
+  }
+  size_t power = kMinClassSize;
+  while (power <= size / 2) {
+    power *= 2;
+  }
+  const size_t step = power / 4;
+  return (size + step - 1) / step * step;
+}
+
+void* HostAllocator::Allocate(size_t size) {
+  const size_t class_size = ClassSize(size);
+  size_t huge_page_threshold;
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    ++sync_->stats_.allocations;
+    sync_->stats_.bytes_in_use += class_size;
+    map<size_t, vector<void*> >::iterator it =
+        sync_->free_lists_.find(class_size);
+    if (it != sync_->free_lists_.end() && !it->second.empty()) {
+      void* ptr = it->second.back();
+      it->second.pop_back();
+      ++sync_->stats_.cache_hits;
+      sync_->stats_.bytes_cached -= class_size;
+      return ptr;
+    }
+    huge_page_threshold = sync_->huge_page_threshold_;
+  }
+  void* ptr = NULL;
+  if (huge_page_threshold && class_size >= huge_page_threshold) {
+    CHECK_EQ(posix_memalign(&ptr, kHugePageSize, class_size), 0)
+        << "host allocation of size " << size << " failed";
+#ifdef MADV_HUGEPAGE
+    // Only a hint: the buffer is still usable if the kernel declines.
+    madvise(ptr, class_size, MADV_HUGEPAGE);
+#endif
+  } else {
+    CHECK_EQ(posix_memalign(&ptr, kAlignment, class_size), 0)
+        << "host allocation of size " << size << " failed";
+  }
+  return ptr;
+}
+
+void HostAllocator::Free(void* ptr, size_t size) {
+  const size_t class_size = ClassSize(size);
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    sync_->stats_.bytes_in_use -= class_size;
+    if (sync_->stats_.bytes_cached + class_size <= sync_->cache_limit_) {
+      sync_->free_lists_[class_size].push_back(ptr);
+      sync_->stats_.bytes_cached += class_size;
+      return;
+    }
+  }
+  free(ptr);
+}
+
+void HostAllocator::Trim() {
+  map<size_t, vector<void*> > free_lists;
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    free_lists.swap(sync_->free_lists_);
+    sync_->stats_.bytes_cached = 0;
+  }
+  for (map<size_t, vector<void*> >::iterator it = free_lists.begin();
+       it != free_lists.end(); ++it) {
+    for (int i = 0; i < it->second.size(); ++i) {
+      free(it->second[i]);
+    }
+  }
+}
+
+HostAllocator::Stats HostAllocator::stats() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return sync_->stats_;
+}
+
+size_t HostAllocator::cache_limit() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return sync_->cache_limit_;
+}
+
+size_t HostAllocator::huge_page_threshold() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return sync_->huge_page_threshold_;
+}
+
+void HostAllocator::set_huge_page_threshold(size_t bytes) {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  sync_->huge_page_threshold_ = bytes;
+}
+
+void HostAllocator::set_cache_limit(size_t bytes) {
+  // Lowering the limit only returns enough buffers to fit under it, taking
+  // those of the largest classes first.
+  vector<void*> evicted;
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    sync_->cache_limit_ = bytes;
+    map<size_t, vector<void*> >::reverse_iterator it =
+        sync_->free_lists_.rbegin();
+    while (sync_->stats_.bytes_cached > bytes) {
+      CHECK(it != sync_->free_lists_.rend());
+      if (it->second.empty()) {
+        ++it;
+        continue;
+      }
+      evicted.push_back(it->second.back());
+      it->second.pop_back();
+      sync_->stats_.bytes_cached -= it->first;
+    }
+  }
+  for (int i = 0; i < evicted.size(); ++i) {
+    free(evicted[i]);
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,75 @@
+#include <boost/thread.hpp>
+#include <opencv2/core/core.hpp>
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "caffe/util/image_cache.hpp"
+
+namespace caffe {
+
+class ImageCache::sync {
+ public:
+  typedef std::list<pair<string, cv::Mat> > List;
+
+  sync() : size_(0) { }
+
+  mutable boost::mutex mutex_;
+  // Most recently used images first.
+  List lru_;
+  map<string, List::iterator> index_;
+  size_t size_;
+};
+
+static size_t ImageBytes(const cv::Mat& image) {
+  return image.total() * image.elemSize();
+}
+
+ImageCache::ImageCache(size_t capacity)
+    : capacity_(capacity), sync_(new sync()) {
+}
+
+bool ImageCache::Get(const string& key, cv::Mat* image) {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  map<string, sync::List::iterator>::iterator it = sync_->index_.find(key);
+  if (it == sync_->index_.end()) {
+    return false;
+  }
+  sync_->lru_.splice(sync_->lru_.begin(), sync_->lru_, it->second);
+  *image = it->second->second;
+  return true;
+}
+
+bool ImageCache::Contains(const string& key) const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return sync_->index_.count(key) > 0;
+}
+
+void ImageCache::Put(const string& key, const cv::Mat& image) {
+  const size_t bytes = ImageBytes(image);
+  if (bytes > capacity_) {
+    return;
+  }
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  if (sync_->index_.count(key)) {
+    return;
+  }
+  while (sync_->size_ + bytes > capacity_) {
+    const pair<string, cv::Mat>& oldest = sync_->lru_.back();
+    sync_->size_ -= ImageBytes(oldest.second);
+    sync_->index_.erase(oldest.first);
+    sync_->lru_.pop_back();
+  }
+  sync_->lru_.push_front(make_pair(key, image));
+  sync_->index_[key] = sync_->lru_.begin();
+  sync_->size_ += bytes;
+}
+
+size_t ImageCache::size() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return sync_->size_;
+}
+
+}  // namespace caffe
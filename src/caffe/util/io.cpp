@@ -1,3 +1,4 @@
+#include <boost/thread.hpp>
 #include <fcntl.h>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
@@ -7,9 +8,11 @@
 #include <opencv2/highgui/highgui_c.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <stdint.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <fstream>  // NOLINT(readability/streams)
+#include <iterator>
 #include <string>
 #include <vector>
 
@@ -67,12 +70,104 @@ void WriteProtoToBinaryFile(const Message& proto, const char* filename) {
   CHECK(proto.SerializeToOstream(&output));
 }
 
-cv::Mat ReadImageToCVMat(const string& filename,
-    const int height, const int width, const bool is_color) {
-  cv::Mat cv_img;
+#if CV_MAJOR_VERSION >= 3
+// Reads the size of a JPEG from its frame header, without decoding it.
+static bool ReadJPEGSize(const uchar* data, size_t size,
+    int* height, int* width) {
+  if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+    return false;
+  }
+  size_t pos = 2;
+  while (pos + 4 <= size) {
+    if (data[pos] != 0xFF) {
+      return false;
+    }
+    const uchar marker = data[pos + 1];
+    if (marker == 0xFF) {  // fill byte
+      ++pos;
+      continue;
+    }
+    // Start of frame markers, except DHT, JPG and DAC in the same range.
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+        marker != 0xC8 && marker != 0xCC) {
+      if (pos + 9 > size) {
+        return false;
+      }
+      *height = (data[pos + 5] << 8) | data[pos + 6];
+      *width = (data[pos + 7] << 8) | data[pos + 8];
+      return true;
+    }
+    pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+  }
+  return false;
+}
+#endif
+
+// Returns the imdecode flag for data, which asks libjpeg to scale its DCT by
+// the largest of 1/2, 1/4 or 1/8 that still covers min_height x min_width.
+static int ReducedReadFlag(const uchar* data, size_t size, bool is_color,
+    int min_height, int min_width) {
   int cv_read_flag = (is_color ? CV_LOAD_IMAGE_COLOR :
     CV_LOAD_IMAGE_GRAYSCALE);
-  cv::Mat cv_img_origin = cv::imread(filename, cv_read_flag);
+#if CV_MAJOR_VERSION >= 3
+  int height, width;
+  if (min_height <= 0 || min_width <= 0 ||
+      !ReadJPEGSize(data, size, &height, &width)) {
+    return cv_read_flag;
+  }
+  // OpenCV applies the EXIF orientation after decoding, which may swap the
+  // axes, so both must cover the larger of the requested sides.
+  const int min_side = std::max(min_height, min_width);
+  for (int scale = 8; scale > 1; scale /= 2) {
+    // libjpeg rounds the scaled size up.
+    if ((height + scale - 1) / scale >= min_side &&
+        (width + scale - 1) / scale >= min_side) {
+      switch (scale) {
+      case 8:
+        return is_color ? cv::IMREAD_REDUCED_COLOR_8 :
+            cv::IMREAD_REDUCED_GRAYSCALE_8;
+      case 4:
+        return is_color ? cv::IMREAD_REDUCED_COLOR_4 :
+            cv::IMREAD_REDUCED_GRAYSCALE_4;
+      default:
+        return is_color ? cv::IMREAD_REDUCED_COLOR_2 :
+            cv::IMREAD_REDUCED_GRAYSCALE_2;
+      }
+    }
+  }
+#endif
+  return cv_read_flag;
+}
+
+cv::Mat DecodeImageToCVMat(const char* data, size_t size, bool is_color,
+    int min_height, int min_width) {
+  const uchar* bytes = reinterpret_cast<const uchar*>(data);
+  // Wrap the encoded bytes instead of copying them.
+  cv::Mat encoded(1, size, CV_8UC1, const_cast<uchar*>(bytes));
+  return cv::imdecode(encoded,
+      ReducedReadFlag(bytes, size, is_color, min_height, min_width));
+}
+
+cv::Mat ReadImageToCVMat(const string& filename,
+    const int height, const int width, const bool is_color,
+    const bool reduced_decode) {
+  cv::Mat cv_img;
+  cv::Mat cv_img_origin;
+  if (reduced_decode && height > 0 && width > 0) {
+    // The image is resized anyway, so decode no more of it than needed.
+    string buffer;
+    std::ifstream file(filename.c_str(), ios::in | ios::binary);
+    if (file.is_open()) {
+      buffer.assign(std::istreambuf_iterator<char>(file),
+          std::istreambuf_iterator<char>());
+      cv_img_origin = DecodeImageToCVMat(buffer.data(), buffer.size(),
+          is_color, height, width);
+    }
+  } else {
+    int cv_read_flag = (is_color ? CV_LOAD_IMAGE_COLOR :
+      CV_LOAD_IMAGE_GRAYSCALE);
+    cv_img_origin = cv::imread(filename, cv_read_flag);
+  }
   if (!cv_img_origin.data) {
     LOG(ERROR) << "Could not open or find file " << filename;
     return cv_img_origin;
@@ -85,6 +180,11 @@ cv::Mat ReadImageToCVMat(const string& filename,
   return cv_img;
 }
 
+cv::Mat ReadImageToCVMat(const string& filename,
+    const int height, const int width, const bool is_color) {
+  return ReadImageToCVMat(filename, height, width, is_color, false);
+}
+
 cv::Mat ReadImageToCVMat(const string& filename,
     const int height, const int width) {
   return ReadImageToCVMat(filename, height, width, true);
@@ -156,6 +256,16 @@ bool ReadFileToDatum(const string& filename, const int label,
   }
 }
 
+void ReadAheadFile(const string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    // Left for the actual read to report.
+    return;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+}
+
 cv::Mat DecodeDatumToCVMatNative(const Datum& datum) {
   cv::Mat cv_img;
   CHECK(datum.encoded()) << "Datum not encoded";
@@ -168,13 +278,14 @@ cv::Mat DecodeDatumToCVMatNative(const Datum& datum) {
   return cv_img;
 }
 cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color) {
-  cv::Mat cv_img;
+  return DecodeDatumToCVMat(datum, is_color, 0, 0);
+}
+cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color,
+    int min_height, int min_width) {
   CHECK(datum.encoded()) << "Datum not encoded";
   const string& data = datum.data();
-  std::vector<char> vec_data(data.c_str(), data.c_str() + data.size());
-  int cv_read_flag = (is_color ? CV_LOAD_IMAGE_COLOR :
-    CV_LOAD_IMAGE_GRAYSCALE);
-  cv_img = cv::imdecode(vec_data, cv_read_flag);
+  cv::Mat cv_img = DecodeImageToCVMat(data.data(), data.size(), is_color,
+      min_height, min_width);
   if (!cv_img.data) {
     LOG(ERROR) << "Could not decode datum ";
   }
@@ -228,11 +339,23 @@ void CVMatToDatum(const cv::Mat& cv_img, Datum* datum) {
   datum->set_data(buffer);
 }
 
-// Verifies format of data stored in HDF5 file and reshapes blob accordingly.
-template <typename Dtype>
-void hdf5_load_nd_dataset_helper(
+static boost::recursive_mutex& hdf5_mutex() {
+  static boost::recursive_mutex mutex;
+  return mutex;
+}
+
+HDF5Lock::HDF5Lock() {
+  hdf5_mutex().lock();
+}
+
+HDF5Lock::~HDF5Lock() {
+  hdf5_mutex().unlock();
+}
+
+// Verifies format of data stored in HDF5 file and gets its shape.
+void hdf5_get_nd_dataset_shape(
     hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
-    Blob<Dtype>* blob) {
+    vector<int>* shape) {
   // Verify that the dataset exists.
   CHECK(H5LTfind_dataset(file_id, dataset_name_))
       << "Failed to find HDF5 dataset " << dataset_name_;
@@ -252,13 +375,64 @@ void hdf5_load_nd_dataset_helper(
   CHECK_GE(status, 0) << "Failed to get dataset info for " << dataset_name_;
   CHECK_EQ(class_, H5T_FLOAT) << "Expected float or double data";
 
-  vector<int> blob_dims(dims.size());
+  shape->resize(dims.size());
   for (int i = 0; i < dims.size(); ++i) {
-    blob_dims[i] = dims[i];
+    (*shape)[i] = dims[i];
   }
+}
+
+// Verifies format of data stored in HDF5 file and reshapes blob accordingly.
+template <typename Dtype>
+void hdf5_load_nd_dataset_helper(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    Blob<Dtype>* blob) {
+  vector<int> blob_dims;
+  hdf5_get_nd_dataset_shape(file_id, dataset_name_, min_dim, max_dim,
+      &blob_dims);
   blob->Reshape(blob_dims);
 }
 
+template <typename Dtype>
+void hdf5_load_nd_dataset_rows(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    int row_offset, int num_rows, Blob<Dtype>* blob) {
+  vector<int> blob_dims;
+  hdf5_get_nd_dataset_shape(file_id, dataset_name_, min_dim, max_dim,
+      &blob_dims);
+  CHECK_GE(row_offset, 0);
+  CHECK_LE(row_offset + num_rows, blob_dims[0])
+      << "Rows out of range for dataset " << dataset_name_;
+  blob_dims[0] = num_rows;
+  blob->Reshape(blob_dims);
+
+  // Select the rows in the file, as a hyperslab spanning the other axes.
+  std::vector<hsize_t> offset(blob_dims.size(), 0);
+  std::vector<hsize_t> count(blob_dims.begin(), blob_dims.end());
+  offset[0] = row_offset;
+  hid_t dataset_id = H5Dopen2(file_id, dataset_name_, H5P_DEFAULT);
+  CHECK_GE(dataset_id, 0) << "Failed to open dataset " << dataset_name_;
+  hid_t file_space = H5Dget_space(dataset_id);
+  herr_t status = H5Sselect_hyperslab(file_space, H5S_SELECT_SET,
+      offset.data(), NULL, count.data(), NULL);
+  CHECK_GE(status, 0) << "Failed to select rows of dataset " << dataset_name_;
+  hid_t mem_space = H5Screate_simple(count.size(), count.data(), NULL);
+  const hid_t mem_type =
+      sizeof(Dtype) == sizeof(float) ? H5T_NATIVE_FLOAT : H5T_NATIVE_DOUBLE;
+  status = H5Dread(dataset_id, mem_type, mem_space, file_space, H5P_DEFAULT,
+      blob->mutable_cpu_data());
+  CHECK_GE(status, 0) << "Failed to read rows of dataset " << dataset_name_;
+  H5Sclose(mem_space);
+  H5Sclose(file_space);
+  H5Dclose(dataset_id);
+}
+
+template void hdf5_load_nd_dataset_rows<float>(hid_t file_id,
+    const char* dataset_name_, int min_dim, int max_dim, int row_offset,
+    int num_rows, Blob<float>* blob);
+template void hdf5_load_nd_dataset_rows<double>(hid_t file_id,
+    const char* dataset_name_, int min_dim, int max_dim, int row_offset,
+    int num_rows, Blob<double>* blob);
+
 template <>
 void hdf5_load_nd_dataset<float>(hid_t file_id, const char* dataset_name_,
         int min_dim, int max_dim, Blob<float>* blob) {
@@ -303,4 +477,61 @@ void hdf5_save_nd_dataset<double>(
   CHECK_GE(status, 0) << "Failed to make double dataset " << dataset_name;
 }
 
+template <typename Dtype>
+void hdf5_append_nd_dataset(
+    const hid_t file_id, const string& dataset_name, const Blob<Dtype>& blob) {
+  hsize_t dims[HDF5_NUM_DIMS];
+  dims[0] = blob.num();
+  dims[1] = blob.channels();
+  dims[2] = blob.height();
+  dims[3] = blob.width();
+  const hid_t mem_type =
+      sizeof(Dtype) == sizeof(float) ? H5T_NATIVE_FLOAT : H5T_NATIVE_DOUBLE;
+  hid_t dataset_id;
+  hsize_t offset[HDF5_NUM_DIMS] = { 0, 0, 0, 0 };
+  if (!H5Lexists(file_id, dataset_name.c_str(), H5P_DEFAULT)) {
+    // Chunks of one blob's rows, so each append writes whole chunks.
+    hsize_t max_dims[HDF5_NUM_DIMS] = { H5S_UNLIMITED, dims[1], dims[2],
+        dims[3] };
+    hid_t space_id = H5Screate_simple(HDF5_NUM_DIMS, dims, max_dims);
+    hid_t plist_id = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(plist_id, HDF5_NUM_DIMS, dims);
+    dataset_id = H5Dcreate2(file_id, dataset_name.c_str(), mem_type,
+        space_id, H5P_DEFAULT, plist_id, H5P_DEFAULT);
+    H5Pclose(plist_id);
+    H5Sclose(space_id);
+    CHECK_GE(dataset_id, 0) << "Failed to make dataset " << dataset_name;
+  } else {
+    dataset_id = H5Dopen2(file_id, dataset_name.c_str(), H5P_DEFAULT);
+    CHECK_GE(dataset_id, 0) << "Failed to open dataset " << dataset_name;
+    hsize_t old_dims[HDF5_NUM_DIMS];
+    hid_t space_id = H5Dget_space(dataset_id);
+    CHECK_EQ(H5Sget_simple_extent_ndims(space_id), HDF5_NUM_DIMS);
+    H5Sget_simple_extent_dims(space_id, old_dims, NULL);
+    H5Sclose(space_id);
+    for (int i = 1; i < HDF5_NUM_DIMS; ++i) {
+      CHECK_EQ(old_dims[i], dims[i]) << "Shape mismatch appending to dataset "
+          << dataset_name;
+    }
+    offset[0] = old_dims[0];
+    old_dims[0] += dims[0];
+    herr_t status = H5Dset_extent(dataset_id, old_dims);
+    CHECK_GE(status, 0) << "Failed to extend dataset " << dataset_name;
+  }
+  hid_t file_space = H5Dget_space(dataset_id);
+  H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset, NULL, dims, NULL);
+  hid_t mem_space = H5Screate_simple(HDF5_NUM_DIMS, dims, NULL);
+  herr_t status = H5Dwrite(dataset_id, mem_type, mem_space, file_space,
+      H5P_DEFAULT, blob.cpu_data());
+  CHECK_GE(status, 0) << "Failed to append to dataset " << dataset_name;
+  H5Sclose(mem_space);
+  H5Sclose(file_space);
+  H5Dclose(dataset_id);
+}
+
+template void hdf5_append_nd_dataset<float>(
+    const hid_t file_id, const string& dataset_name, const Blob<float>& blob);
+template void hdf5_append_nd_dataset<double>(
+    const hid_t file_id, const string& dataset_name, const Blob<double>& blob);
+
 }  // namespace caffe
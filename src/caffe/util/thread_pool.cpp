@@ -0,0 +1,64 @@
+#include <boost/thread.hpp>
+#include <vector>
+
+#include "caffe/internal_thread.hpp"
+#include "caffe/util/thread_pool.hpp"
+
+namespace caffe {
+
+class ThreadPool::Worker : public InternalThread {
+ public:
+  Worker(ThreadPool* pool, int id)
+      : pool_(pool), id_(id) {}
+  virtual ~Worker() { StopInternalThread(); }
+
+  BlockingQueue<int> todo_;
+
+ protected:
+  virtual void InternalThreadEntry() {
+    try {
+      while (!must_stop()) {
+        todo_.pop();
+        (*pool_->job_)(id_);
+        pool_->done_.push(id_);
+      }
+    } catch (boost::thread_interrupted&) {
+      // Interrupted exception is expected on shutdown
+    }
+  }
+
+  ThreadPool* pool_;
+  int id_;
+};
+
+ThreadPool::ThreadPool(int size)
+    : size_(size), job_(NULL) {
+  CHECK_GT(size_, 0) << "A thread pool needs at least one worker.";
+  for (int i = 1; i < size_; ++i) {
+    workers_.push_back(shared_ptr<Worker>(new Worker(this, i)));
+    CHECK(workers_.back()->StartInternalThread())
+        << "Thread execution failed";
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  // Stop the workers before done_ goes away.
+  workers_.clear();
+}
+
+void ThreadPool::Run(const boost::function<void(int)>& job) {
+  // The workers reference job until they report back, so the calling
+  // thread must not be interrupted while waiting for them.
+  boost::this_thread::disable_interruption no_interruption;
+  job_ = &job;
+  for (int i = 0; i < workers_.size(); ++i) {
+    workers_[i]->todo_.push(i);
+  }
+  job(0);
+  for (int i = 0; i < workers_.size(); ++i) {
+    done_.pop();
+  }
+  job_ = NULL;
+}
+
+}  // namespace caffe
@@ -235,6 +235,16 @@ int time() {
   const vector<vector<Blob<float>*> >& top_vecs = caffe_net.top_vecs();
   const vector<vector<bool> >& bottom_need_backward =
       caffe_net.bottom_need_backward();
+  std::vector<caffe::BasePrefetchingDataLayer<float>*> data_layers;
+  for (int i = 0; i < layers.size(); ++i) {
+    caffe::BasePrefetchingDataLayer<float>* data_layer =
+        dynamic_cast<caffe::BasePrefetchingDataLayer<float>*>(
+            layers[i].get());
+    if (data_layer) {
+      data_layer->ResetStats();
+      data_layers.push_back(data_layer);
+    }
+  }
   LOG(INFO) << "*** Benchmark begins ***";
   LOG(INFO) << "Testing for " << FLAGS_iterations << " iterations.";
   Timer total_timer;
@@ -288,6 +298,12 @@ int time() {
   LOG(INFO) << "Average Forward-Backward: " << total_timer.MilliSeconds() /
     FLAGS_iterations << " ms.";
   LOG(INFO) << "Total Time: " << total_timer.MilliSeconds() << " ms.";
+  if (!data_layers.empty()) {
+    LOG(INFO) << "Data layer stages: ";
+    for (int i = 0; i < data_layers.size(); ++i) {
+      data_layers[i]->LogStats();
+    }
+  }
   LOG(INFO) << "*** Benchmark ends ***";
   return 0;
 }
@@ -4,13 +4,19 @@
 #include <utility>
 #include <vector>
 
+#include "boost/bind.hpp"
+#include "boost/random/uniform_real.hpp"
 #include "boost/scoped_ptr.hpp"
+#include "boost/thread.hpp"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/rng.hpp"
+#include "caffe/util/thread_pool.hpp"
 
 using namespace caffe;  // NOLINT(build/namespaces)
 
@@ -19,7 +25,56 @@ using std::pair;
 using boost::scoped_ptr;
 
 DEFINE_string(backend, "lmdb",
-        "The backend {leveldb, lmdb} containing the images");
+        "The backend {leveldb, lmdb, recordfile} containing the images");
+DEFINE_int32(threads, 0,
+    "Number of threads decoding and summing images (0 for one per core)");
+DEFINE_double(sample, 1,
+    "Fraction of the images, picked at random, the mean is computed over");
+DEFINE_int32(sample_seed, 1701, "Seed of the random pick of --sample");
+DEFINE_string(mean_value_file, "",
+    "Optional: file to write the per channel means to, as the mean_value "
+    "fields of a transform_param");
+
+// Records are summed a chunk at a time: while the workers decode and sum a
+// chunk, the next one is read from the database.
+const int kChunkSize = 1000;
+
+// Per worker sums, in double precision so that they stay exact for uint8
+// data over any realistic number of images.
+struct Sum {
+  Sum() : count(0) { }
+  std::vector<double> data;
+  int count;
+};
+
+void SumChunk(int worker_id, int num_workers,
+    const std::vector<std::string>* chunk, std::vector<Sum>* sums) {
+  Sum& sum = (*sums)[worker_id];
+  const int data_size = sum.data.size();
+  double* sum_data = &sum.data[0];
+  Datum datum;
+  for (int i = worker_id; i < chunk->size(); i += num_workers) {
+    datum.ParseFromString((*chunk)[i]);
+    DecodeDatumNative(&datum);
+
+    const std::string& data = datum.data();
+    const int size_in_datum = std::max<int>(datum.data().size(),
+        datum.float_data_size());
+    CHECK_EQ(size_in_datum, data_size) << "Incorrect data field size " <<
+        size_in_datum;
+    if (data.size() != 0) {
+      const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data.data());
+      for (int j = 0; j < data_size; ++j) {
+        sum_data[j] += bytes[j];
+      }
+    } else {
+      for (int j = 0; j < data_size; ++j) {
+        sum_data[j] += datum.float_data(j);
+      }
+    }
+    ++sum.count;
+  }
+}
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
@@ -39,16 +94,17 @@ int main(int argc, char** argv) {
     gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/compute_image_mean");
     return 1;
   }
+  CHECK(FLAGS_sample > 0 && FLAGS_sample <= 1)
+      << "--sample must be in (0, 1]";
 
   scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
   db->Open(argv[1], db::READ);
   scoped_ptr<db::Cursor> cursor(db->NewCursor());
 
   BlobProto sum_blob;
-  int count = 0;
   // load first datum
   Datum datum;
-  datum.ParseFromString(cursor->value());
+  datum.ParseFromArray(cursor->value_data(), cursor->value_size());
 
   if (DecodeDatumNative(&datum)) {
     LOG(INFO) << "Decoding Datum";
@@ -59,46 +115,69 @@ int main(int argc, char** argv) {
   sum_blob.set_height(datum.height());
   sum_blob.set_width(datum.width());
   const int data_size = datum.channels() * datum.height() * datum.width();
-  int size_in_datum = std::max<int>(datum.data().size(),
-                                    datum.float_data_size());
-  for (int i = 0; i < size_in_datum; ++i) {
-    sum_blob.add_data(0.);
+
+  int threads = FLAGS_threads;
+  if (threads <= 0) {
+    threads = std::max<int>(1, boost::thread::hardware_concurrency());
+  }
+  LOG(INFO) << "Summing with " << threads << " threads";
+  ThreadPool pool(threads);
+  std::vector<Sum> sums(pool.size());
+  for (int i = 0; i < sums.size(); ++i) {
+    sums[i].data.resize(data_size, 0.);
   }
-  LOG(INFO) << "Starting Iteration";
-  while (cursor->valid()) {
-    Datum datum;
-    datum.ParseFromString(cursor->value());
-    DecodeDatumNative(&datum);
 
-    const std::string& data = datum.data();
-    size_in_datum = std::max<int>(datum.data().size(),
-        datum.float_data_size());
-    CHECK_EQ(size_in_datum, data_size) << "Incorrect data field size " <<
-        size_in_datum;
-    if (data.size() != 0) {
-      CHECK_EQ(data.size(), size_in_datum);
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) + (uint8_t)data[i]);
-      }
-    } else {
-      CHECK_EQ(datum.float_data_size(), size_in_datum);
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) +
-            static_cast<float>(datum.float_data(i)));
+  caffe::rng_t sample_rng(FLAGS_sample_seed);
+  boost::uniform_real<double> random_unit(0, 1);
+  std::vector<std::string> chunks[2];
+  boost::thread summer;
+  int read = 0;
+  double seconds = 0;
+  CPUTimer timer;
+  timer.Start();
+  LOG(INFO) << "Starting Iteration";
+  for (int n = 1, c = 0; cursor->valid(); ++n, c = 1 - c) {
+    std::vector<std::string>* chunk = &chunks[c];
+    chunk->clear();
+    for (; cursor->valid() && chunk->size() < kChunkSize; cursor->Next()) {
+      ++read;
+      if (FLAGS_sample < 1 && random_unit(sample_rng) >= FLAGS_sample) {
+        continue;
       }
+      chunk->push_back(std::string(
+          static_cast<const char*>(cursor->value_data()),
+          cursor->value_size()));
+    }
+    // Sum the chunk once the previous one is summed.
+    if (summer.joinable()) {
+      summer.join();
     }
-    ++count;
-    if (count % 10000 == 0) {
-      LOG(INFO) << "Processed " << count << " files.";
+    boost::function<void(int)> job = boost::bind(&SumChunk, _1, pool.size(),
+        chunk, &sums);
+    boost::thread(&ThreadPool::Run, &pool, job).swap(summer);
+    if (n % 10 == 0 || !cursor->valid()) {
+      seconds += timer.Seconds();
+      timer.Start();
+      LOG(INFO) << "Processed " << read << " files, "
+          << (seconds > 0 ? read / seconds : 0) << " files/s.";
     }
-    cursor->Next();
+  }
+  if (summer.joinable()) {
+    summer.join();
   }
 
-  if (count % 10000 != 0) {
-    LOG(INFO) << "Processed " << count << " files.";
+  std::vector<double> total(data_size, 0.);
+  int count = 0;
+  for (int i = 0; i < sums.size(); ++i) {
+    for (int j = 0; j < data_size; ++j) {
+      total[j] += sums[i].data[j];
+    }
+    count += sums[i].count;
   }
-  for (int i = 0; i < sum_blob.data_size(); ++i) {
-    sum_blob.set_data(i, sum_blob.data(i) / count);
+  CHECK_GT(count, 0) << "No images sampled";
+  LOG(INFO) << "Mean over " << count << " of " << read << " files.";
+  for (int i = 0; i < data_size; ++i) {
+    sum_blob.add_data(total[i] / count);
   }
   // Write to disk
   if (argc == 3) {
@@ -107,13 +186,20 @@ int main(int argc, char** argv) {
   }
   const int channels = sum_blob.channels();
   const int dim = sum_blob.height() * sum_blob.width();
-  std::vector<float> mean_values(channels, 0.0);
+  TransformationParameter mean_values;
   LOG(INFO) << "Number of channels: " << channels;
   for (int c = 0; c < channels; ++c) {
+    double mean_value = 0;
     for (int i = 0; i < dim; ++i) {
-      mean_values[c] += sum_blob.data(dim * c + i);
+      mean_value += total[dim * c + i];
     }
-    LOG(INFO) << "mean_value channel [" << c << "]:" << mean_values[c] / dim;
+    mean_value /= static_cast<double>(dim) * count;
+    mean_values.add_mean_value(mean_value);
+    LOG(INFO) << "mean_value channel [" << c << "]:" << mean_value;
+  }
+  if (!FLAGS_mean_value_file.empty()) {
+    LOG(INFO) << "Write mean_value to " << FLAGS_mean_value_file;
+    WriteProtoToTextFile(mean_values, FLAGS_mean_value_file);
   }
   return 0;
 }
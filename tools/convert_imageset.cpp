@@ -14,14 +14,18 @@
 #include <utility>
 #include <vector>
 
+#include "boost/bind.hpp"
 #include "boost/scoped_ptr.hpp"
+#include "boost/thread.hpp"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/rng.hpp"
+#include "caffe/util/thread_pool.hpp"
 
 using namespace caffe;  // NOLINT(build/namespaces)
 using std::pair;
@@ -32,7 +36,7 @@ DEFINE_bool(gray, false,
 DEFINE_bool(shuffle, false,
     "Randomly shuffle the order of images and their labels");
 DEFINE_string(backend, "lmdb",
-        "The backend {lmdb, leveldb} for storing the result");
+        "The backend {lmdb, leveldb, recordfile} for storing the result");
 DEFINE_int32(resize_width, 0, "Width images are resized to");
 DEFINE_int32(resize_height, 0, "Height images are resized to");
 DEFINE_bool(check_size, false,
@@ -41,6 +45,99 @@ DEFINE_bool(encoded, false,
     "When this option is on, the encoded image will be save in datum");
 DEFINE_string(encode_type, "",
     "Optional: What type should we encode the image as ('png','jpg',...).");
+DEFINE_int32(threads, 0,
+    "Number of threads reading, resizing and encoding images "
+    "(0 for one per core)");
+
+// Images are converted a chunk at a time: while the workers read, resize and
+// encode a chunk, the previous one is written out in list order and
+// committed.
+const int kChunkSize = 1000;
+
+struct Chunk {
+  int begin, end;
+  // Serialized Datum of each line, empty if the image could not be read.
+  std::vector<std::string> values;
+  // Size of the data field, and channels * height * width, of each Datum,
+  // for check_size.
+  std::vector<int> data_sizes;
+  std::vector<int> image_sizes;
+};
+
+struct Progress {
+  Progress() : count(0), data_size(0), seconds(0) { timer.Start(); }
+  int count;
+  int data_size;
+  double seconds;
+  CPUTimer timer;
+};
+
+void EncodeChunk(int worker_id, int num_workers,
+    const std::vector<std::pair<std::string, int> >& lines,
+    const std::string& root_folder, Chunk* chunk) {
+  const bool is_color = !FLAGS_gray;
+  const bool encoded = FLAGS_encoded;
+  const int resize_height = std::max<int>(0, FLAGS_resize_height);
+  const int resize_width = std::max<int>(0, FLAGS_resize_width);
+  Datum datum;
+  for (int line_id = chunk->begin + worker_id; line_id < chunk->end;
+       line_id += num_workers) {
+    const int i = line_id - chunk->begin;
+    chunk->values[i].clear();
+    std::string enc = FLAGS_encode_type;
+    if (encoded && !enc.size()) {
+      // Guess the encoding type from the file name
+      string fn = lines[line_id].first;
+      size_t p = fn.rfind('.');
+      if ( p == fn.npos )
+        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
+      enc = fn.substr(p);
+      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
+    }
+    bool status = ReadImageToDatum(root_folder + lines[line_id].first,
+        lines[line_id].second, resize_height, resize_width, is_color,
+        enc, &datum);
+    if (status == false) continue;
+    chunk->data_sizes[i] = datum.data().size();
+    chunk->image_sizes[i] = datum.channels() * datum.height() * datum.width();
+    CHECK(datum.SerializeToString(&chunk->values[i]));
+  }
+}
+
+void WriteChunk(db::DB* db,
+    const std::vector<std::pair<std::string, int> >& lines,
+    const Chunk* chunk, Progress* progress) {
+  const int kMaxKeyLength = 256;
+  char key_cstr[kMaxKeyLength];
+  scoped_ptr<db::Transaction> txn(db->NewTransaction());
+  int written = 0;
+  for (int line_id = chunk->begin; line_id < chunk->end; ++line_id) {
+    const int i = line_id - chunk->begin;
+    if (chunk->values[i].empty()) continue;
+    if (FLAGS_check_size) {
+      if (progress->count == 0 && written == 0) {
+        progress->data_size = chunk->image_sizes[i];
+      } else {
+        CHECK_EQ(chunk->data_sizes[i], progress->data_size)
+            << "Incorrect data field size " << chunk->data_sizes[i];
+      }
+    }
+    // sequential
+    int length = snprintf(key_cstr, kMaxKeyLength, "%08d_%s", line_id,
+        lines[line_id].first.c_str());
+    txn->Put(string(key_cstr, length), chunk->values[i]);
+    ++written;
+  }
+  txn->Commit();
+  progress->count += written;
+  progress->seconds += progress->timer.Seconds();
+  progress->timer.Start();
+  LOG(ERROR) << "Processed " << progress->count << " files ("
+      << chunk->end << " of " << lines.size() << " lines), "
+      << (progress->seconds > 0 ? progress->count / progress->seconds : 0)
+      << " files/s.";
+}
+
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
@@ -62,11 +159,6 @@ int main(int argc, char** argv) {
     return 1;
   }
 
-  const bool is_color = !FLAGS_gray;
-  const bool check_size = FLAGS_check_size;
-  const bool encoded = FLAGS_encoded;
-  const string encode_type = FLAGS_encode_type;
-
   std::ifstream infile(argv[2]);
   std::vector<std::pair<std::string, int> > lines;
   std::string filename;
@@ -81,72 +173,46 @@ int main(int argc, char** argv) {
   }
   LOG(INFO) << "A total of " << lines.size() << " images.";
 
-  if (encode_type.size() && !encoded)
+  if (FLAGS_encode_type.size() && !FLAGS_encoded)
     LOG(INFO) << "encode_type specified, assuming encoded=true.";
 
-  int resize_height = std::max<int>(0, FLAGS_resize_height);
-  int resize_width = std::max<int>(0, FLAGS_resize_width);
+  int threads = FLAGS_threads;
+  if (threads <= 0) {
+    threads = std::max<int>(1, boost::thread::hardware_concurrency());
+  }
+  LOG(INFO) << "Converting with " << threads << " threads";
+  ThreadPool pool(threads);
 
-  // Create new DB
+  // Create new DB. Keys are written in increasing order of their line id,
+  // as long as it fits the 8 digits of the keys.
   scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
   db->Open(argv[3], db::NEW);
-  scoped_ptr<db::Transaction> txn(db->NewTransaction());
+  db->set_sorted_writes(lines.size() <= 100000000);
 
   // Storing to db
   std::string root_folder(argv[1]);
-  Datum datum;
-  int count = 0;
-  const int kMaxKeyLength = 256;
-  char key_cstr[kMaxKeyLength];
-  int data_size = 0;
-  bool data_size_initialized = false;
-
-  for (int line_id = 0; line_id < lines.size(); ++line_id) {
-    bool status;
-    std::string enc = encode_type;
-    if (encoded && !enc.size()) {
-      // Guess the encoding type from the file name
-      string fn = lines[line_id].first;
-      size_t p = fn.rfind('.');
-      if ( p == fn.npos )
-        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
-      enc = fn.substr(p);
-      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
-    }
-    status = ReadImageToDatum(root_folder + lines[line_id].first,
-        lines[line_id].second, resize_height, resize_width, is_color,
-        enc, &datum);
-    if (status == false) continue;
-    if (check_size) {
-      if (!data_size_initialized) {
-        data_size = datum.channels() * datum.height() * datum.width();
-        data_size_initialized = true;
-      } else {
-        const std::string& data = datum.data();
-        CHECK_EQ(data.size(), data_size) << "Incorrect data field size "
-            << data.size();
-      }
-    }
-    // sequential
-    int length = snprintf(key_cstr, kMaxKeyLength, "%08d_%s", line_id,
-        lines[line_id].first.c_str());
-
-    // Put in db
-    string out;
-    CHECK(datum.SerializeToString(&out));
-    txn->Put(string(key_cstr, length), out);
-
-    if (++count % 1000 == 0) {
-      // Commit db
-      txn->Commit();
-      txn.reset(db->NewTransaction());
-      LOG(ERROR) << "Processed " << count << " files.";
+  Chunk chunks[2];
+  Progress progress;
+  boost::thread writer;
+  for (int begin = 0, c = 0; begin < lines.size(); begin += kChunkSize,
+       c = 1 - c) {
+    Chunk* chunk = &chunks[c];
+    chunk->begin = begin;
+    chunk->end = std::min<int>(begin + kChunkSize, lines.size());
+    chunk->values.resize(chunk->end - begin);
+    chunk->data_sizes.resize(chunk->end - begin);
+    chunk->image_sizes.resize(chunk->end - begin);
+    pool.Run(boost::bind(&EncodeChunk, _1, pool.size(), boost::cref(lines),
+        boost::cref(root_folder), chunk));
+    // Write the chunk once the previous one is written.
+    if (writer.joinable()) {
+      writer.join();
     }
+    boost::thread(&WriteChunk, db.get(), boost::cref(lines), chunk,
+        &progress).swap(writer);
   }
-  // write the last batch
-  if (count % 1000 != 0) {
-    txn->Commit();
-    LOG(ERROR) << "Processed " << count << " files.";
+  if (writer.joinable()) {
+    writer.join();
   }
   return 0;
 }
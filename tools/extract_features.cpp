@@ -3,6 +3,7 @@
 #include <vector>
 
 #include "boost/algorithm/string.hpp"
+#include "boost/thread.hpp"
 #include "google/protobuf/text_format.h"
 
 #include "caffe/blob.hpp"
@@ -21,6 +22,148 @@ using boost::shared_ptr;
 using std::string;
 namespace db = caffe::db;
 
+// Writes the feature rows of one blob, in extraction order.
+class FeatureWriter {
+ public:
+  FeatureWriter(const string& blob_name, int channels, int height, int width)
+      : blob_name_(blob_name), channels_(channels), height_(height),
+        width_(width), dim_(channels * height * width), rows_(0) { }
+  virtual ~FeatureWriter() { }
+  // Appends the rows of dim features each held by features.
+  virtual void Write(const std::vector<float>& features) = 0;
+  virtual void Close() = 0;
+
+ protected:
+  string blob_name_;
+  int channels_, height_, width_, dim_;
+  int rows_;
+};
+
+// Stores each row as a Datum of float_data in a leveldb/lmdb/recordfile,
+// under its row index as key.
+class DBFeatureWriter : public FeatureWriter {
+ public:
+  DBFeatureWriter(const string& name, const string& backend,
+      const string& blob_name, int channels, int height, int width)
+      : FeatureWriter(blob_name, channels, height, width),
+        db_(db::GetDB(backend)) {
+    db_->Open(name, db::NEW);
+    txn_.reset(db_->NewTransaction());
+    datum_.set_channels(channels);
+    datum_.set_height(height);
+    datum_.set_width(width);
+  }
+  virtual void Write(const std::vector<float>& features) {
+    const int kMaxKeyStrLength = 100;
+    char key_str[kMaxKeyStrLength];
+    CHECK_EQ(features.size() % dim_, 0);
+    for (int n = 0; n < features.size() / dim_; ++n) {
+      datum_.clear_float_data();
+      for (int d = 0; d < dim_; ++d) {
+        datum_.add_float_data(features[n * dim_ + d]);
+      }
+      int length = snprintf(key_str, kMaxKeyStrLength, "%d", rows_);
+      string out;
+      CHECK(datum_.SerializeToString(&out));
+      txn_->Put(std::string(key_str, length), out);
+      ++rows_;
+      if (rows_ % 1000 == 0) {
+        txn_->Commit();
+        txn_.reset(db_->NewTransaction());
+        LOG(ERROR)<< "Extracted features of " << rows_ <<
+            " query images for feature blob " << blob_name_;
+      }
+    }
+  }
+  virtual void Close() {
+    if (rows_ % 1000 != 0) {
+      txn_->Commit();
+    }
+    LOG(ERROR)<< "Extracted features of " << rows_ <<
+        " query images for feature blob " << blob_name_;
+    db_->Close();
+  }
+
+ protected:
+  shared_ptr<db::DB> db_;
+  shared_ptr<db::Transaction> txn_;
+  Datum datum_;
+};
+
+// Appends the rows to a dense row-major float32 matrix: either a raw file
+// described by a text file name.index holding "rows dim channels height
+// width", or a .npy file whose header is filled in on Close.
+class MatrixFeatureWriter : public FeatureWriter {
+ public:
+  MatrixFeatureWriter(const string& name, bool npy, const string& blob_name,
+      int channels, int height, int width)
+      : FeatureWriter(blob_name, channels, height, width), name_(name),
+        npy_(npy) {
+    file_ = fopen(name.c_str(), "wb");
+    CHECK(file_) << "Failed to open " << name;
+    if (npy_) {
+      // Room for the header, written once the number of rows is known.
+      CHECK_EQ(fseek(file_, kNpyHeaderSize, SEEK_SET), 0);
+    }
+  }
+  virtual void Write(const std::vector<float>& features) {
+    CHECK_EQ(features.size() % dim_, 0);
+    CHECK_EQ(fwrite(&features[0], sizeof(float), features.size(), file_),
+        features.size()) << "Failed to write " << name_;
+    rows_ += features.size() / dim_;
+    if (rows_ / 1000 != (rows_ - features.size() / dim_) / 1000) {
+      LOG(ERROR)<< "Extracted features of " << rows_ <<
+          " query images for feature blob " << blob_name_;
+    }
+  }
+  virtual void Close() {
+    if (npy_) {
+      // Format version 1.0: magic, version, header length and a dict padded
+      // with spaces and a newline to kNpyHeaderSize bytes.
+      char dict[kNpyHeaderSize];
+      int length = snprintf(dict, kNpyHeaderSize,
+          "{'descr': '<f4', 'fortran_order': False, 'shape': (%d, %d), }",
+          rows_, dim_);
+      const int dict_size = kNpyHeaderSize - 10;
+      CHECK_LT(length, dict_size);
+      string header("\x93NUMPY\x01\x00", 8);
+      header += static_cast<char>(dict_size & 0xff);
+      header += static_cast<char>(dict_size >> 8);
+      header += string(dict, length);
+      header.append(dict_size - length - 1, ' ');
+      header += '\n';
+      CHECK_EQ(fseek(file_, 0, SEEK_SET), 0);
+      CHECK_EQ(fwrite(header.data(), 1, header.size(), file_), header.size());
+    } else {
+      const string index_name = name_ + ".index";
+      FILE* index = fopen(index_name.c_str(), "w");
+      CHECK(index) << "Failed to open " << index_name;
+      fprintf(index, "%d %d %d %d %d\n", rows_, dim_, channels_, height_,
+          width_);
+      fclose(index);
+    }
+    CHECK_EQ(fclose(file_), 0) << "Failed to write " << name_;
+    LOG(ERROR)<< "Extracted features of " << rows_ <<
+        " query images for feature blob " << blob_name_;
+  }
+
+ protected:
+  static const int kNpyHeaderSize = 128;
+
+  string name_;
+  bool npy_;
+  FILE* file_;
+};
+
+// Runs on a background thread, overlapped with the Forward of the next
+// mini-batch.
+void WriteFeatures(const std::vector<shared_ptr<FeatureWriter> >* writers,
+    const std::vector<std::vector<float> >* features) {
+  for (int i = 0; i < writers->size(); ++i) {
+    (*writers)[i]->Write((*features)[i]);
+  }
+}
+
 template<typename Dtype>
 int feature_extraction_pipeline(int argc, char** argv);
 
@@ -44,7 +187,9 @@ int feature_extraction_pipeline(int argc, char** argv) {
     "Note: you can extract multiple features in one pass by specifying"
     " multiple feature blob names and dataset names seperated by ','."
     " The names cannot contain white space characters and the number of blobs"
-    " and datasets must be equal.";
+    " and datasets must be equal.\n"
+    "db_type is leveldb, lmdb or recordfile to store a Datum per image, or"
+    " raw or npy to store a dense float32 matrix with a row per image.";
     return 1;
   }
   int arg_pos = num_required_args;
@@ -120,66 +265,54 @@ int feature_extraction_pipeline(int argc, char** argv) {
 
   int num_mini_batches = atoi(argv[++arg_pos]);
 
-  std::vector<shared_ptr<db::DB> > feature_dbs;
-  std::vector<shared_ptr<db::Transaction> > txns;
+  const string db_type(argv[++arg_pos]);
+  std::vector<shared_ptr<FeatureWriter> > writers;
   for (size_t i = 0; i < num_features; ++i) {
     LOG(INFO)<< "Opening dataset " << dataset_names[i];
-    shared_ptr<db::DB> db(db::GetDB(argv[++arg_pos]));
-    db->Open(dataset_names.at(i), db::NEW);
-    feature_dbs.push_back(db);
-    shared_ptr<db::Transaction> txn(db->NewTransaction());
-    txns.push_back(txn);
+    const shared_ptr<Blob<Dtype> > feature_blob = feature_extraction_net
+        ->blob_by_name(blob_names[i]);
+    if (db_type == "raw" || db_type == "npy") {
+      writers.push_back(shared_ptr<FeatureWriter>(new MatrixFeatureWriter(
+          dataset_names[i], db_type == "npy", blob_names[i],
+          feature_blob->channels(), feature_blob->height(),
+          feature_blob->width())));
+    } else {
+      writers.push_back(shared_ptr<FeatureWriter>(new DBFeatureWriter(
+          dataset_names[i], db_type, blob_names[i], feature_blob->channels(),
+          feature_blob->height(), feature_blob->width())));
+    }
   }
 
   LOG(ERROR)<< "Extacting Features";
 
-  Datum datum;
-  const int kMaxKeyStrLength = 100;
-  char key_str[kMaxKeyStrLength];
+  // The features of a mini-batch are copied out of the net and written on
+  // a background thread while the next mini-batch is forwarded.
+  std::vector<std::vector<float> > features[2];
+  boost::thread writer;
   std::vector<Blob<float>*> input_vec;
-  std::vector<int> image_indices(num_features, 0);
   for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index) {
     feature_extraction_net->Forward(input_vec);
+    std::vector<std::vector<float> >& batch_features =
+        features[batch_index % 2];
+    batch_features.resize(num_features);
     for (int i = 0; i < num_features; ++i) {
       const shared_ptr<Blob<Dtype> > feature_blob = feature_extraction_net
           ->blob_by_name(blob_names[i]);
-      int batch_size = feature_blob->num();
-      int dim_features = feature_blob->count() / batch_size;
-      const Dtype* feature_blob_data;
-      for (int n = 0; n < batch_size; ++n) {
-        datum.set_height(feature_blob->height());
-        datum.set_width(feature_blob->width());
-        datum.set_channels(feature_blob->channels());
-        datum.clear_data();
-        datum.clear_float_data();
-        feature_blob_data = feature_blob->cpu_data() +
-            feature_blob->offset(n);
-        for (int d = 0; d < dim_features; ++d) {
-          datum.add_float_data(feature_blob_data[d]);
-        }
-        int length = snprintf(key_str, kMaxKeyStrLength, "%d",
-            image_indices[i]);
-        string out;
-        CHECK(datum.SerializeToString(&out));
-        txns.at(i)->Put(std::string(key_str, length), out);
-        ++image_indices[i];
-        if (image_indices[i] % 1000 == 0) {
-          txns.at(i)->Commit();
-          txns.at(i).reset(feature_dbs.at(i)->NewTransaction());
-          LOG(ERROR)<< "Extracted features of " << image_indices[i] <<
-              " query images for feature blob " << blob_names[i];
-        }
-      }  // for (int n = 0; n < batch_size; ++n)
+      const Dtype* feature_blob_data = feature_blob->cpu_data();
+      batch_features[i].assign(feature_blob_data,
+          feature_blob_data + feature_blob->count());
     }  // for (int i = 0; i < num_features; ++i)
+    if (writer.joinable()) {
+      writer.join();
+    }
+    boost::thread(&WriteFeatures, &writers, &batch_features).swap(writer);
   }  // for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index)
+  if (writer.joinable()) {
+    writer.join();
+  }
   // write the last batch
   for (int i = 0; i < num_features; ++i) {
-    if (image_indices[i] % 1000 != 0) {
-      txns.at(i)->Commit();
-    }
-    LOG(ERROR)<< "Extracted features of " << image_indices[i] <<
-        " query images for feature blob " << blob_names[i];
-    feature_dbs.at(i)->Close();
+    writers[i]->Close();
   }
 
   LOG(ERROR)<< "Successfully extracted the features!";